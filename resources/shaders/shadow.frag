@@ -0,0 +1,11 @@
+#version 440 core
+
+in vec4 fragmentPosition;
+
+uniform vec3 lightPos;
+uniform float farPlane;
+
+void main()
+{
+    gl_FragDepth = length(fragmentPosition.xyz - lightPos) / farPlane; // Linear distance in [0, 1]
+}
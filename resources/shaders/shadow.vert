@@ -0,0 +1,10 @@
+#version 440 core
+
+layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
+
+uniform mat4 model;
+
+void main()
+{
+    gl_Position = model * vec4(position, 1.0f); // World space; the geometry shader projects per face
+}
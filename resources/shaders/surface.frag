@@ -0,0 +1,135 @@
+#version 440 core
+
+// Variant defines (injected after #version): TEXTURED, LIT, SPECULAR, ALPHA_TEST, BINDLESS
+
+#ifdef BINDLESS
+#extension GL_ARB_bindless_texture : require
+#endif
+
+#define MAX_TEXTURE_ARRAYS 4 // Matches MAX_TEXTURE_ARRAYS in the application
+
+#ifdef LIT
+in vec3 vertexNormal; // For incoming normals
+in vec3 vertexFragmentPos; // For incoming fragment position
+#endif
+#ifdef TEXTURED
+in vec2 vertexTextureCoordinate;
+#endif
+flat in uint vertexMaterialIndex;
+
+out vec4 fragmentColor; // For outgoing color to the GPU
+
+// Per-material inputs, indexed by the object's material
+struct MaterialData
+{
+    vec4 color;          // rgb: base color when untextured, a: alpha test cutoff
+    vec2 uvScale;
+    int textureArray;    // Which of materialTextures holds the base color
+    int textureLayer;
+    uvec2 textureHandle; // Bindless handle of the array with the material's sampler
+};
+
+layout(std430, binding = 6) readonly buffer Materials { MaterialData materials[]; };
+
+#if defined(TEXTURED) && !defined(BINDLESS)
+layout(binding = 2) uniform sampler2DArray materialTextures[MAX_TEXTURE_ARRAYS]; // Same-size textures share an array
+#endif
+
+// Uniform / Global variables for light color, light position, and camera/view position
+#ifdef LIT
+uniform vec3 lightColor;
+uniform vec3 lightPos;
+uniform vec3 viewPosition;
+layout(binding = 1) uniform samplerCube shadowMap; // Light to nearest caster distance, divided by shadowFarPlane
+uniform float shadowFarPlane;
+uniform int pcfSamples; // Percentage-closer filtering taps: 1, 8 or 20
+
+// PCF offset directions; the first 8 are the cube corners
+const vec3 pcfOffsets[20] = vec3[](
+    vec3(1, 1, 1), vec3(1, -1, 1), vec3(-1, -1, 1), vec3(-1, 1, 1),
+    vec3(1, 1, -1), vec3(1, -1, -1), vec3(-1, -1, -1), vec3(-1, 1, -1),
+    vec3(1, 1, 0), vec3(1, -1, 0), vec3(-1, -1, 0), vec3(-1, 1, 0),
+    vec3(1, 0, 1), vec3(-1, 0, 1), vec3(1, 0, -1), vec3(-1, 0, -1),
+    vec3(0, 1, 1), vec3(0, -1, 1), vec3(0, -1, -1), vec3(0, 1, -1)
+);
+
+// Fraction of the fragment that is hidden from the light
+float shadowFactor(vec3 fragmentPos)
+{
+    vec3 lightToFragment = fragmentPos - lightPos;
+    float currentDepth = length(lightToFragment);
+    float bias = 0.05f;
+
+    if (pcfSamples <= 1)
+        return currentDepth - bias > texture(shadowMap, lightToFragment).r * shadowFarPlane ? 1.0 : 0.0;
+
+    // Widen the filter with distance from the viewer to soften far shadows
+    float diskRadius = (1.0 + length(viewPosition - fragmentPos) / shadowFarPlane) / 25.0;
+    float shadow = 0.0;
+    for (int i = 0; i < pcfSamples; ++i)
+    {
+        float closestDepth = texture(shadowMap, lightToFragment + pcfOffsets[i] * diskRadius).r * shadowFarPlane;
+        if (currentDepth - bias > closestDepth)
+            shadow += 1.0;
+    }
+    return shadow / float(pcfSamples);
+}
+#endif
+
+void main()
+{
+    MaterialData material = materials[vertexMaterialIndex];
+
+    // Base color: the texture when there is one, otherwise the flat material color
+#ifdef TEXTURED
+    vec3 textureCoordinate = vec3(vertexTextureCoordinate * material.uvScale, float(material.textureLayer));
+#ifdef BINDLESS
+    vec4 baseColor = texture(sampler2DArray(material.textureHandle), textureCoordinate);
+#else
+    // The index is the same for the whole draw, which makes it dynamically uniform
+    vec4 baseColor = texture(materialTextures[material.textureArray], textureCoordinate);
+#endif
+#else
+    vec4 baseColor = vec4(material.color.rgb, 1.0);
+#endif
+
+#ifdef ALPHA_TEST
+    if (baseColor.a < material.color.a)
+        discard;
+#endif
+
+#ifdef LIT
+    /*Phong lighting model calculations to generate ambient, diffuse, and specular components*/
+
+    //Calculate Ambient lighting*/
+    float ambientStrength = 0.1f; // Set ambient or global lighting strength
+    vec3 ambient = ambientStrength * lightColor; // Generate ambient light color
+
+    //Calculate Diffuse lighting*/
+    vec3 norm = normalize(vertexNormal); // Normalize vectors to 1 unit
+    vec3 lightDirection = normalize(lightPos - vertexFragmentPos); // Calculate distance (light direction) between light source and fragments/pixels on cube
+    float impact = max(dot(norm, lightDirection), 0.0);// Calculate diffuse impact by generating dot product of normal and light
+    vec3 diffuse = impact * lightColor; // Generate diffuse light color
+
+#ifdef SPECULAR
+    //Calculate Specular lighting*/
+    float specularIntensity = 0.8f; // Set specular light strength
+    float highlightSize = 16.0f; // Set specular highlight size
+    vec3 viewDir = normalize(viewPosition - vertexFragmentPos); // Calculate view direction
+    vec3 reflectDir = reflect(-lightDirection, norm);// Calculate reflection vector
+    //Calculate specular component
+    float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
+    vec3 specular = specularIntensity * specularComponent * lightColor;
+#else
+    vec3 specular = vec3(0.0);
+#endif
+
+    // Calculate phong result; shadowed fragments keep only the ambient term
+    float shadow = shadowFactor(vertexFragmentPos);
+    vec3 phong = (ambient + (1.0 - shadow) * (diffuse + specular)) * baseColor.xyz;
+
+    fragmentColor = vec4(phong, 1.0); // Send lighting results to GPU
+#else
+    fragmentColor = vec4(baseColor.xyz, 1.0); // Unlit: the base color as is
+#endif
+}
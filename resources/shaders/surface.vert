@@ -0,0 +1,52 @@
+#version 440 core
+
+// Variant defines (injected after #version): TEXTURED, LIT, SPECULAR, ALPHA_TEST, BINDLESS
+
+layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
+#ifdef LIT
+layout(location = 1) in vec3 normal; // VAP position 1 for normals
+#endif
+#ifdef TEXTURED
+layout(location = 2) in vec2 textureCoordinate;
+#endif
+layout(location = 3) in uint objectIndex; // Per object (divisor 1), selected by the draw's baseInstance
+
+// Written by UUpdateSceneObjects; the same buffer the cull pass reads
+struct ObjectData
+{
+    mat4 model;
+    vec4 boundsMin;
+    vec4 boundsMax;
+    uvec4 drawInfo; // vertex count, first vertex, material index, unused
+};
+
+layout(std430, binding = 0) readonly buffer Objects { ObjectData objects[]; };
+
+#ifdef LIT
+out vec3 vertexNormal; // For outgoing normals to fragment shader
+out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
+#endif
+#ifdef TEXTURED
+out vec2 vertexTextureCoordinate;
+#endif
+flat out uint vertexMaterialIndex;
+
+//Uniform / Global variables for the  transform matrices
+uniform mat4 view;
+uniform mat4 projection;
+
+void main()
+{
+    mat4 model = objects[objectIndex].model;
+    gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
+
+#ifdef LIT
+    vertexFragmentPos = vec3(model * vec4(position, 1.0f)); // Gets fragment / pixel position in world space only (exclude view and projection)
+
+    vertexNormal = mat3(transpose(inverse(model))) * normal; // get normal vectors in world space only and exclude normal translation properties
+#endif
+#ifdef TEXTURED
+    vertexTextureCoordinate = textureCoordinate;
+#endif
+    vertexMaterialIndex = objects[objectIndex].drawInfo.z;
+}
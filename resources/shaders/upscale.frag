@@ -0,0 +1,30 @@
+#version 440 core
+
+in vec2 textureCoordinate;
+
+out vec4 fragmentColor;
+
+uniform sampler2D sceneColor;
+uniform vec2 uvScale;    // Rendered region / target size
+uniform float sharpness; // 0 gives plain bilinear
+
+// Bilinear sample that never reads outside the rendered region
+vec3 sampleScene(vec2 uv, vec2 halfTexel)
+{
+    return texture(sceneColor, clamp(uv, halfTexel, uvScale - halfTexel)).rgb;
+}
+
+void main()
+{
+    vec2 texel = 1.0 / vec2(textureSize(sceneColor, 0));
+    vec2 halfTexel = 0.5 * texel;
+    vec2 uv = textureCoordinate * uvScale;
+
+    // Unsharp mask: push the bilinear result away from the average of its neighbours
+    vec3 center = sampleScene(uv, halfTexel);
+    vec3 neighbours = sampleScene(uv + vec2(texel.x, 0.0), halfTexel) + sampleScene(uv - vec2(texel.x, 0.0), halfTexel) +
+                      sampleScene(uv + vec2(0.0, texel.y), halfTexel) + sampleScene(uv - vec2(0.0, texel.y), halfTexel);
+    vec3 sharpened = center + sharpness * (center - 0.25 * neighbours);
+
+    fragmentColor = vec4(clamp(sharpened, 0.0, 1.0), 1.0);
+}
@@ -0,0 +1,11 @@
+#version 440 core
+
+out vec2 textureCoordinate;
+
+void main()
+{
+    // One triangle covering the screen, generated from the vertex index
+    vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    textureCoordinate = corner;
+    gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);
+}
@@ -1,5 +1,36 @@
-#include <iostream>         // cout, cerr
+#include <cstdint>          // intptr_t
 #include <cstdlib>          // EXIT_FAILURE
+#include <vector>           // vector
+#include <map>              // map
+#include <deque>            // deque
+#include <array>            // array
+#include <string>           // string
+#include <algorithm>        // max, stable_sort
+#include <tuple>            // tie
+#include <atomic>           // atomic
+#include <thread>           // thread
+#include <chrono>           // steady_clock
+#include <cstdio>           // fwrite, vsnprintf
+#include <cstdarg>          // va_list
+#include <cstring>          // strlen
+#include <cmath>            // sqrt
+#include <csignal>          // signal
+#include <fstream>          // ifstream
+#include <sstream>          // ostringstream
+#include <mutex>            // mutex
+#include <condition_variable> // condition_variable
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>    // inotify_init1, inotify_add_watch
+#include <unistd.h>         // read, close
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>      // SSE2 intrinsics for the software rasterizer
+#define SOFTWARE_RASTERIZER_SSE
+#endif
 #include <GL/glew.h>        // GLEW library
 #include <GLFW/glfw3.h>     // GLFW library
 #define STB_IMAGE_IMPLEMENTATION
@@ -14,11 +45,53 @@
 
 using namespace std; // Standard namespace
 
-/*Shader program Macro*/
-#ifndef GLSL
-#define GLSL(Version, Source) "#version " #Version " core \n" #Source
+/*Directory the GLSL files are loaded from and watched for changes*/
+#ifndef SHADER_DIRECTORY
+#define SHADER_DIRECTORY "../../resources/shaders/"
+#endif
+
+/*Log levels; records below LOG_COMPILE_LEVEL are compiled out*/
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARNING 2
+#define LOG_LEVEL_ERROR 3
+
+#ifndef LOG_COMPILE_LEVEL
+#ifdef NDEBUG
+#define LOG_COMPILE_LEVEL LOG_LEVEL_INFO
+#else
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+#endif
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_DEBUG
+#define ULOG_DEBUG(...) ULog(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define ULOG_DEBUG(...) ((void)0)
 #endif
 
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_INFO
+#define ULOG_INFO(...) ULog(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define ULOG_INFO(...) ((void)0)
+#endif
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_WARNING
+#define ULOG_WARNING(...) ULog(LOG_LEVEL_WARNING, __VA_ARGS__)
+#else
+#define ULOG_WARNING(...) ((void)0)
+#endif
+
+#define ULOG_ERROR(...) ULog(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+/*Logs at most MaxPerSecond records per second from this call site; the rest are counted as rate limited*/
+#define ULOG_RATE_LIMITED(Level, MaxPerSecond, ...) \
+    do { \
+        static LogRateLimiter logRateLimiter_(MaxPerSecond); \
+        if ((Level) >= LOG_COMPILE_LEVEL && ULogAllow(logRateLimiter_)) \
+            ULog((Level), __VA_ARGS__); \
+    } while (0)
+
 // Unnamed namespace
 namespace
 {
@@ -28,28 +101,860 @@ namespace
     const int WINDOW_WIDTH = 800;
     const int WINDOW_HEIGHT = 600;
 
+    // Log ring size (a power of two) and the longest record text
+    const size_t LOG_RING_CAPACITY = 1024;
+    const size_t LOG_RECORD_TEXT_SIZE = 512;
+
+    // Number of GPU timer queries in flight for dynamic resolution
+    const int DYNAMIC_RESOLUTION_QUERY_COUNT = 4;
+
+    // Point light shadow cube map size and range
+    const int SHADOW_MAP_SIZE = 1024;
+    const float SHADOW_FAR_PLANE = 25.0f;
+
+    // Material textures without bindless handles: array i is on unit MATERIAL_TEXTURE_UNIT + i.
+    // MAX_TEXTURE_ARRAYS matches the define in surface.frag.
+    const GLuint MATERIAL_TEXTURE_UNIT = 2;
+    const int MAX_TEXTURE_ARRAYS = 4;
+
+    // Released buffers and textures are kept for reuse up to this many bytes, and for this many frames
+    const size_t GPU_POOL_BUDGET = 64 * 1024 * 1024;
+    const unsigned long long GPU_POOL_MAX_AGE = 600;
+
+    // Software rasterizer tile size in pixels (even, so 2x2 quads never straddle tiles), and the
+    // most vertices a triangle can have after clipping against the near and far planes
+    const int SOFTWARE_TILE_SIZE = 32;
+    const int SOFTWARE_MAX_CLIPPED_VERTICES = 8;
+
+    // Backend comparison: a pixel differs if any channel is off by more than the tolerance,
+    // and the images match if at most this fraction of pixels differ
+    const int IMAGE_DIFF_TOLERANCE = 16;
+    const double IMAGE_DIFF_MAX_MISMATCH = 0.01;
+
+    // Frame capture: readbacks in flight, frames waiting for an encoder before new ones are dropped,
+    // encoder thread cap, and how long shutdown waits for the last readbacks (nanoseconds)
+    const int CAPTURE_RING_SIZE = 3;
+    const size_t CAPTURE_QUEUE_DEPTH = 8;
+    const int CAPTURE_MAX_ENCODERS = 4;
+    const GLuint64 CAPTURE_FLUSH_TIMEOUT = 1000000000;
+
+    // PCF offset directions, the same as pcfOffsets in surface.frag; the first 8 are the cube corners
+    const glm::vec3 PCF_OFFSETS[20] = {
+        glm::vec3(1, 1, 1), glm::vec3(1, -1, 1), glm::vec3(-1, -1, 1), glm::vec3(-1, 1, 1),
+        glm::vec3(1, 1, -1), glm::vec3(1, -1, -1), glm::vec3(-1, -1, -1), glm::vec3(-1, 1, -1),
+        glm::vec3(1, 1, 0), glm::vec3(1, -1, 0), glm::vec3(-1, -1, 0), glm::vec3(-1, 1, 0),
+        glm::vec3(1, 0, 1), glm::vec3(-1, 0, 1), glm::vec3(1, 0, -1), glm::vec3(-1, 0, -1),
+        glm::vec3(0, 1, 1), glm::vec3(0, -1, 1), glm::vec3(0, -1, -1), glm::vec3(0, 1, -1)
+    };
+
+    // GPU object categories tracked by the resource registry
+    enum GpuResourceType
+    {
+        GPU_RESOURCE_BUFFER,
+        GPU_RESOURCE_TEXTURE,
+        GPU_RESOURCE_VERTEX_ARRAY,
+        GPU_RESOURCE_FRAMEBUFFER,
+        GPU_RESOURCE_SAMPLER,
+        GPU_RESOURCE_PROGRAM,
+        GPU_RESOURCE_TYPE_COUNT
+    };
+
+    const char* const GPU_RESOURCE_TYPE_NAMES[GPU_RESOURCE_TYPE_COUNT] = { "buffers", "textures", "vertexArrays", "framebuffers", "samplers", "programs" };
+
+    // Immutable storage of a texture; also the key textures are pooled under
+    struct GpuTextureDesc
+    {
+        GLenum target;          // GL_TEXTURE_2D, GL_TEXTURE_2D_ARRAY or GL_TEXTURE_CUBE_MAP
+        GLsizei levels;
+        GLenum internalFormat;
+        GLsizei width;
+        GLsizei height;
+        GLsizei depth = 1;      // Layers of a GL_TEXTURE_2D_ARRAY
+
+        bool operator<(const GpuTextureDesc& other) const
+        {
+            return std::tie(target, levels, internalFormat, width, height, depth) <
+                std::tie(other.target, other.levels, other.internalFormat, other.width, other.height, other.depth);
+        }
+    };
+
+    // What the registry knows about a live resource
+    struct GpuResourceInfo
+    {
+        std::string label;
+        size_t bytes = 0;               // Storage size; 0 where GL doesn't say (VAOs, programs, ...)
+        GLenum usage = 0;               // Buffers
+        GpuTextureDesc textureDesc = {}; // Textures
+        bool isPoolable = true;         // Cleared once a texture has a bindless handle; its state is frozen
+    };
+
+    // A released buffer or texture waiting to be reused
+    struct PooledGpuResource
+    {
+        GLuint id;
+        unsigned long long frame; // When it was released
+    };
+
+    // Every GL object the application creates goes through here, so memory use and live counts are
+    // known per category and anything not destroyed by shutdown is reported as a leak
+    struct GpuResourceRegistry
+    {
+        std::map<std::pair<int, GLuint>, GpuResourceInfo> live;    // (GpuResourceType, name)
+        size_t liveCount[GPU_RESOURCE_TYPE_COUNT] = {};
+        size_t liveBytes[GPU_RESOURCE_TYPE_COUNT] = {};
+        size_t peakBytes = 0;                                       // Live and pooled
+
+        std::multimap<std::pair<size_t, GLenum>, PooledGpuResource> bufferPool; // By (bytes, usage)
+        std::multimap<GpuTextureDesc, PooledGpuResource> texturePool;
+        size_t pooledBytes = 0;
+        size_t poolBudget = GPU_POOL_BUDGET;
+        size_t poolHits = 0;
+        size_t poolMisses = 0;
+        unsigned long long frame = 0;
+        bool isShutDown = false;        // The context is gone; handles released after this only drop their name
+    };
+
+    // Owns one GL object created through a GpuResourceRegistry. Letting go of it (reset, move
+    // assignment or destruction) hands the object back to the registry, which pools or deletes it.
+    // Converts to the GL name, so it can be passed straight to GL calls.
+    class GpuHandle
+    {
+    public:
+        GpuHandle() = default;
+        GpuHandle(GpuResourceRegistry* registry, GpuResourceType type, GLuint id) : registry(registry), type(type), id(id) {}
+        GpuHandle(GpuHandle&& other) noexcept : registry(other.registry), type(other.type), id(other.release()) {}
+        GpuHandle(const GpuHandle&) = delete;
+        ~GpuHandle() { reset(); }
+
+        GpuHandle& operator=(GpuHandle&& other) noexcept
+        {
+            if (this != &other)
+            {
+                reset();
+                registry = other.registry;
+                type = other.type;
+                id = other.release();
+            }
+            return *this;
+        }
+        GpuHandle& operator=(const GpuHandle&) = delete;
+
+        void reset();
+
+        // Gives up ownership without releasing the object
+        GLuint release()
+        {
+            GLuint released = id;
+            id = 0;
+            return released;
+        }
+
+        operator GLuint() const& { return id; }
+        operator GLuint() const&& = delete; // A temporary would release the object straight away
+
+    private:
+        GpuResourceRegistry* registry = nullptr;
+        GpuResourceType type = GPU_RESOURCE_BUFFER;
+        GLuint id = 0;
+    };
+
+
     // Stores the GL data relative to a given mesh
     struct GLMesh
     {
-        GLuint vao;         // Handle for the vertex array object
-        GLuint vbo;         // Handle for the vertex buffer object
+        GLint firstVertex;  // Where the mesh starts in the scene vertex buffer
         GLuint nVertices;    // Number of indices of the mesh
+        glm::vec3 boundsMin; // Object space bounding box, used for culling
+        glm::vec3 boundsMax;
+        std::vector<GLfloat> vertices;  // CPU copy, 7 floats per vertex; read by the software rasterizer
+        bool hasTextureCoordinates;     // Attribute 2 holds real texture coordinates
+    };
+
+    // Every mesh's vertices in one buffer behind one VAO, so draws of different meshes can share a multi-draw
+    struct SceneGeometry
+    {
+        GpuHandle vao;
+        GpuHandle vbo;
+        GpuHandle objectIndexBuffer;   // 0, 1, 2, ... as instanced attribute 3: a draw's baseInstance becomes its object index
+        size_t objectIndexCapacity = 0;
+    };
+
+    // Layout of a single glDrawArraysIndirect command
+    struct DrawArraysIndirectCommand
+    {
+        GLuint count;
+        GLuint instanceCount;
+        GLuint first;
+        GLuint baseInstance;
+    };
+
+    // Per-object data uploaded for the GPU culling pass (std430 layout)
+    struct GpuObjectData
+    {
+        glm::mat4 model;
+        glm::vec4 boundsMin;
+        glm::vec4 boundsMax;
+        GLuint drawInfo[4]; // vertex count, first vertex, material index, first object of the draw batch
+    };
+
+    // Optional shading features; each one is a #define in the surface shader
+    enum ShaderFeature
+    {
+        SHADER_FEATURE_TEXTURED = 1 << 0,   // Base color from uTexture instead of objectColor
+        SHADER_FEATURE_LIT = 1 << 1,        // Ambient and diffuse from the key light, with shadows
+        SHADER_FEATURE_SPECULAR = 1 << 2,   // Phong highlight; needs LIT
+        SHADER_FEATURE_ALPHA_TEST = 1 << 3, // Discard below alphaCutoff; needs TEXTURED
+        SHADER_FEATURE_COUNT = 4
+    };
+
+    // Define names, in bit order
+    const char* const SHADER_FEATURE_DEFINES[SHADER_FEATURE_COUNT] = { "TEXTURED", "LIT", "SPECULAR", "ALPHA_TEST" };
+
+    // How an object is shaded; the features pick the smallest shader variant that covers it
+    struct Material
+    {
+        unsigned features;                      // ShaderFeature bits
+        glm::vec3 color;                        // Base color when not TEXTURED
+        const char* textureFile = nullptr;      // Base color texture when TEXTURED
+        glm::vec2 uvScale = glm::vec2(1.0f);
+        GLint wrapMode = GL_REPEAT;             // Selects a shared sampler object
+        float alphaCutoff = 0.5f;               // ALPHA_TEST threshold
+
+        // Filled in by UCreateMaterials
+        GLuint index = 0;                       // Entry in the material buffer
+        int textureArray = -1;                  // Array holding the texture, and its layer
+        int textureLayer = 0;
+        GLuint samplerId = 0;
+        GLuint64 textureHandle = 0;             // Bindless handle for the array with samplerId
+    };
+
+    // Material as read by surface.frag (std430 layout)
+    struct GpuMaterialData
+    {
+        glm::vec4 color;        // rgb base color, a alpha cutoff
+        glm::vec2 uvScale;
+        GLint textureArray;
+        GLint textureLayer;
+        GLuint64 textureHandle;
+        GLuint64 padding;       // std430 rounds the struct up to 16 bytes
+    };
+
+    // Same-size RGBA8 textures packed as the layers of one GL_TEXTURE_2D_ARRAY
+    struct TextureArray
+    {
+        GpuHandle textureId;
+        int width = 0;
+        int height = 0;
+        int layers = 0;
+    };
+
+    // An image read from disk, waiting to be copied into its array layer
+    struct LoadedTexture
+    {
+        std::string fileName;
+        int width = 0;
+        int height = 0;
+        unsigned char* pixels = nullptr;
+        int textureArray = 0;
+        int layer = 0;
+    };
+
+    // Every material, with the GPU data that lets draws reach their textures without binding them
+    struct MaterialSystem
+    {
+        std::vector<Material*> materials;
+        std::vector<TextureArray> textureArrays;
+        std::map<GLint, GpuHandle> samplers;                    // Wrap mode -> sampler object
+        std::map<std::pair<GLuint, GLuint>, GLuint64> handles;  // (array, sampler) -> resident bindless handle
+        GpuHandle materialBuffer;           // GpuMaterialData per material, SSBO binding 6
+        bool hasBindless = false;           // ARB_bindless_texture
+        bool isDirty = true;                // materialBuffer is out of date
+    };
+
+    // An object in the scene, drawn through the indirect command buffers
+    struct SceneObject
+    {
+        const GLMesh* mesh;         // Geometry drawn for this object
+        const Material* material;   // Shading features and their inputs
+        glm::mat4 model;    // World transform
+        bool castsShadow = true; // Drawn into the point light shadow map
+        bool isStatic = true;    // Static casters are cached; dynamic ones are redrawn every frame
+    };
+
+    // A run of scene objects drawn with one multi-draw: same shader variant and, without bindless
+    // handles, the same material sampler
+    struct DrawBatch
+    {
+        unsigned features;      // Normalized ShaderFeature bits
+        GLuint samplerId;       // Bound to every material texture unit; 0 when the batch samples no texture
+        GLuint firstObject;     // Index of the first object, and of its command in the indirect buffers
+        GLsizei objectCount;
+    };
+
+    // Offscreen target the scene is rendered into; its depth feeds the Hi-Z pyramid.
+    // With dynamic resolution only the bottom-left renderWidth x renderHeight region is used.
+    struct RenderTarget
+    {
+        GpuHandle fbo;
+        GpuHandle colorTexture;
+        GpuHandle depthTexture;
+        int width = 0;
+        int height = 0;
+        int renderWidth = 0;
+        int renderHeight = 0;
+    };
+
+    // How the rendered region is scaled up to the window
+    enum UpscaleFilter
+    {
+        UPSCALE_BILINEAR,
+        UPSCALE_SHARPENED
+    };
+
+    // Dynamic resolution: a feedback controller on measured GPU frame time picks the render scale
+    struct DynamicResolution
+    {
+        bool isEnabled = true;
+        float scale = 1.0f;     // Render size / window size, per axis
+        float minScale = 0.5f;
+        float maxScale = 1.0f;  // The scene target is window sized, so 1 is the ceiling
+        float headroom = 0.9f;  // Fraction of the frame budget the GPU is allowed to use
+        float gain = 0.2f;      // How far each step moves toward the scale that meets the budget
+        float sharpness = 0.5f; // Unsharp mask strength of the sharpened filter
+        UpscaleFilter filter = UPSCALE_SHARPENED;
+        GLuint timerQueries[DYNAMIC_RESOLUTION_QUERY_COUNT] = {};
+        bool isQueryPending[DYNAMIC_RESOLUTION_QUERY_COUNT] = {};
+        int queryFrame = 0;
+        double gpuFrameTime = 0.0; // Latest measured GPU frame time in seconds
+        GpuHandle fullscreenVao;
+    };
+
+    // Two-phase GPU occlusion culling state
+    struct OcclusionCuller
+    {
+        GpuHandle hiZTexture;        // Max-depth mip pyramid built from the phase 1 depth
+        int hiZLevels = 0;           // Allocated levels
+        int activeWidth = 0;         // Level 0 size of the region built this frame
+        int activeHeight = 0;
+        int activeLevels = 0;
+        int hiZWidth = 0;
+        int hiZHeight = 0;
+        GpuHandle objectBuffer;      // GpuObjectData per scene object
+        GpuHandle visibilityBuffer;  // 1 if the object was visible last frame
+        GpuHandle phase1Commands;    // Objects visible last frame
+        GpuHandle phase2Commands;    // Objects that became visible this frame
+        GpuHandle phase1Counts;      // Commands written per draw batch, indexed by the batch's first object
+        GpuHandle phase2Counts;
+        bool hasIndirectCount = false; // ARB_indirect_parameters: commands are compacted and drawn by count
+        GpuHandle statsBuffer;       // visible, frustum culled, occlusion culled
+        GpuHandle statsReadback[3];  // Delayed copies of the stats for the profiler
+        GLsync statsFences[3] = { 0, 0, 0 };
+        int statsFrame = 0;
+        size_t capacity = 0;
+    };
+
+    // Point light shadow maps. Static casters are rendered into a cached cube map that is only
+    // redrawn when the light or one of them moves; dynamic casters are drawn over a copy of it, which
+    // is redone only when the static map or a dynamic caster changes.
+    struct ShadowCache
+    {
+        GpuHandle staticCubeMap;   // Static casters only
+        GpuHandle staticFbo;
+        GpuHandle cubeMap;         // Static + dynamic casters, sampled when there are dynamic casters
+        GpuHandle fbo;
+        bool isValid = false;      // False until the static map has been drawn
+        glm::vec3 lightPosition;   // Light position the static map was drawn from
+        std::vector<glm::mat4> staticCasters; // Static caster transforms the static map was drawn with
+        std::vector<glm::mat4> dynamicCasters; // Dynamic caster transforms the composite was drawn with
+        GLuint sampledCubeMap = 0; // Cube map the scene samples this frame
+        unsigned staticRedraws = 0;
+        unsigned compositeRedraws = 0;
+    };
+
+    // One slot of the log ring. The sequence number tells producers and the consumer whose turn it is.
+    struct LogCell
+    {
+        std::atomic<size_t> sequence;
+        int level;
+        double time; // Seconds since the logger started
+        char text[LOG_RECORD_TEXT_SIZE];
+    };
+
+    // Asynchronous logger: any thread pushes preformatted records into a bounded lock-free ring,
+    // a background thread prefixes them and writes them out in batches
+    struct AsyncLogger
+    {
+        LogCell cells[LOG_RING_CAPACITY];
+        std::atomic<size_t> enqueuePosition{ 0 };
+        size_t dequeuePosition = 0; // Only touched by the worker
+        std::atomic<int> minLevel{ LOG_LEVEL_DEBUG };
+        std::atomic<bool> isRunning{ false };
+        std::atomic<unsigned> dropped{ 0 };     // Records lost because the ring was full
+        std::atomic<unsigned> rateLimited{ 0 }; // Records suppressed by ULOG_RATE_LIMITED
+        std::chrono::steady_clock::time_point startTime;
+        std::thread worker;
+
+        ~AsyncLogger()
+        {
+            // Covers early returns from main; the worker drains the ring before it exits
+            isRunning = false;
+            if (worker.joinable())
+                worker.join();
+        }
+    };
+
+    // Per call site state for ULOG_RATE_LIMITED
+    struct LogRateLimiter
+    {
+        explicit LogRateLimiter(int maxPerSecond) : maxPerSecond(maxPerSecond) {}
+
+        int maxPerSecond;
+        std::atomic<long long> windowStart{ -1 }; // Whole second the current count belongs to
+        std::atomic<int> count{ 0 };
+    };
+
+    // Kinds of queued input events
+    enum InputEventType
+    {
+        INPUT_EVENT_KEY,
+        INPUT_EVENT_MOUSE_BUTTON,
+        INPUT_EVENT_CURSOR,
+        INPUT_EVENT_SCROLL
+    };
+
+    // An input event as delivered by a GLFW callback
+    struct InputEvent
+    {
+        InputEventType type;
+        int code;    // Key or mouse button
+        int action;  // GLFW_PRESS, GLFW_RELEASE or GLFW_REPEAT
+        double x;    // Cursor position or scroll offset
+        double y;
+        double time; // glfwGetTime() when the callback ran
+    };
+
+    // Everything the keyboard can do
+    enum InputAction
+    {
+        ACTION_NONE,
+        ACTION_QUIT,
+        ACTION_MOVE_FORWARD,
+        ACTION_MOVE_BACKWARD,
+        ACTION_MOVE_LEFT,
+        ACTION_MOVE_RIGHT,
+        ACTION_MOVE_UP,
+        ACTION_MOVE_DOWN,
+        ACTION_VIEW_2D,
+        ACTION_VIEW_3D,
+        ACTION_WRAP_REPEAT,
+        ACTION_WRAP_MIRRORED_REPEAT,
+        ACTION_WRAP_CLAMP_TO_EDGE,
+        ACTION_WRAP_CLAMP_TO_BORDER,
+        ACTION_UV_SCALE_UP,
+        ACTION_UV_SCALE_DOWN,
+        ACTION_SHADOW_PCF_1,
+        ACTION_SHADOW_PCF_8,
+        ACTION_SHADOW_PCF_20,
+        ACTION_LAMP_ORBIT,
+        ACTION_LAMP_PAUSE,
+        ACTION_PRESENT_VSYNC,
+        ACTION_PRESENT_ADAPTIVE_VSYNC,
+        ACTION_PRESENT_UNCAPPED,
+        ACTION_CYCLE_FRAME_RATE_LIMIT,
+        ACTION_TOGGLE_DYNAMIC_RESOLUTION,
+        ACTION_TOGGLE_UPSCALE_FILTER,
+        ACTION_TOGGLE_RENDER_ON_DEMAND,
+        ACTION_COUNT
+    };
+
+    struct KeyBinding
+    {
+        int key;
+        InputAction action;
+    };
+
+    // Key bindings
+    const KeyBinding KEY_BINDINGS[] = {
+        { GLFW_KEY_ESCAPE, ACTION_QUIT },
+        { GLFW_KEY_W, ACTION_MOVE_FORWARD },
+        { GLFW_KEY_S, ACTION_MOVE_BACKWARD },
+        { GLFW_KEY_A, ACTION_MOVE_LEFT },
+        { GLFW_KEY_D, ACTION_MOVE_RIGHT },
+        { GLFW_KEY_Q, ACTION_MOVE_UP },
+        { GLFW_KEY_E, ACTION_MOVE_DOWN },
+        { GLFW_KEY_J, ACTION_VIEW_2D },
+        { GLFW_KEY_M, ACTION_VIEW_3D },
+        { GLFW_KEY_1, ACTION_WRAP_REPEAT },
+        { GLFW_KEY_2, ACTION_WRAP_MIRRORED_REPEAT },
+        { GLFW_KEY_3, ACTION_WRAP_CLAMP_TO_EDGE },
+        { GLFW_KEY_4, ACTION_WRAP_CLAMP_TO_BORDER },
+        { GLFW_KEY_RIGHT_BRACKET, ACTION_UV_SCALE_UP },
+        { GLFW_KEY_LEFT_BRACKET, ACTION_UV_SCALE_DOWN },
+        { GLFW_KEY_F1, ACTION_SHADOW_PCF_1 },
+        { GLFW_KEY_F2, ACTION_SHADOW_PCF_8 },
+        { GLFW_KEY_F3, ACTION_SHADOW_PCF_20 },
+        { GLFW_KEY_L, ACTION_LAMP_ORBIT },
+        { GLFW_KEY_K, ACTION_LAMP_PAUSE },
+        { GLFW_KEY_F5, ACTION_PRESENT_VSYNC },
+        { GLFW_KEY_F6, ACTION_PRESENT_ADAPTIVE_VSYNC },
+        { GLFW_KEY_F7, ACTION_PRESENT_UNCAPPED },
+        { GLFW_KEY_F8, ACTION_CYCLE_FRAME_RATE_LIMIT },
+        { GLFW_KEY_F9, ACTION_TOGGLE_DYNAMIC_RESOLUTION },
+        { GLFW_KEY_F10, ACTION_TOGGLE_UPSCALE_FILTER },
+        { GLFW_KEY_F11, ACTION_TOGGLE_RENDER_ON_DEMAND }
+    };
+
+    // Input-to-present latency, measured from the event timestamp to the swap that first shows it
+    struct InputLatency
+    {
+        double oldestPendingEvent = -1.0; // Oldest event not yet presented, or -1
+        double windowStart = 0.0;
+        double total = 0.0;
+        double worst = 0.0;
+        unsigned samples = 0;
+    };
+
+    // How swaps wait for the display
+    enum PresentMode
+    {
+        PRESENT_VSYNC,          // Swap interval 1
+        PRESENT_ADAPTIVE_VSYNC, // Swap interval -1: vsync, but late frames tear instead of waiting
+        PRESENT_UNCAPPED        // Swap interval 0
+    };
+
+    // Frame pacing: present mode, frame limiter, smoothed delta time and frame time statistics
+    struct FramePacer
+    {
+        PresentMode presentMode = PRESENT_VSYNC;
+        double targetFrameTime = 0.0;      // Frame limiter period in seconds, 0 when off
+        double refreshPeriod = 1.0 / 60.0; // Display refresh period, the deadline under vsync
+        double frameStart = 0.0;           // glfwGetTime() at the start of the current frame
+        double smoothedDelta = 1.0 / 60.0;
+        double smoothing = 0.2;            // Weight of the newest frame time in the smoothed delta
+
+        // Statistics over the profiler report interval
+        double windowStart = 0.0;
+        unsigned frames = 0;
+        unsigned missedDeadlines = 0;
+        double frameTimeSum = 0.0;
+        double frameTimeSquaredSum = 0.0;
+    };
+
+    // Frame rate limits cycled through by the frame cap key; 0 is off
+    const double FRAME_RATE_LIMITS[] = { 0.0, 30.0, 60.0, 144.0 };
+
+    // What changed since the last drawn frame; with render-on-demand a frame is drawn only when
+    // one of these is set or something is animating
+    enum RedrawReason
+    {
+        REDRAW_CAMERA = 1 << 0,
+        REDRAW_SCENE = 1 << 1,      // Object transforms
+        REDRAW_LIGHTS = 1 << 2,
+        REDRAW_MATERIALS = 1 << 3,
+        REDRAW_WINDOW = 1 << 4,     // Resized or exposed
+        REDRAW_SHADERS = 1 << 5,    // A program was (re)built
+        REDRAW_SETTINGS = 1 << 6,   // Presentation and resolution options
+        REDRAW_FULL_RESOLUTION = 1 << 7, // The frame left on screen while idle; drawn at full render scale
+        REDRAW_ALL = (1 << 8) - 1
+    };
+
+    // Longest idle wait; shader reloads and statistics are serviced at least this often
+    const double REDRAW_IDLE_TIMEOUT = 0.5;
+
+    // Render-on-demand: change tracking, and how the main loop split its time
+    struct RedrawTracker
+    {
+        bool isOnDemand = false;
+        unsigned dirty = REDRAW_ALL;  // RedrawReason bits; everything, so the first frame is drawn
+
+        // Statistics over the profiler report interval
+        double windowStart = 0.0;
+        unsigned activeFrames = 0;
+        unsigned idleWakeups = 0;   // Idle waits, ended by an event or the timeout
+        double idleTime = 0.0;
+    };
+
+    // One stage of a program loaded from SHADER_DIRECTORY
+    struct ShaderStage
+    {
+        GLenum type;          // GL_VERTEX_SHADER, GL_FRAGMENT_SHADER, ...
+        const char* fileName;
+    };
+
+    // A program owned by the shader manager
+    struct ManagedProgram
+    {
+        std::string name;
+        std::vector<ShaderStage> stages;
+        std::string defines;                  // Inserted after the #version line of every stage
+        GpuHandle* programId = nullptr;       // Last program that linked; this is what the renderer uses
+        GpuHandle pendingProgramId;           // Program still compiling/linking in the background
+        std::vector<GLuint> pendingShaderIds;
+        bool isReloadRequested = false;       // A file changed while the pending compile was running
+    };
+
+    // Loads programs from files, compiles them without blocking and reloads them when their files change
+    struct ShaderManager
+    {
+        std::vector<ManagedProgram> programs;
+        bool hasParallelCompile = false; // KHR_parallel_shader_compile
+        int inotifyFd = -1;
+        int watchDescriptor = -1;
+    };
+
+    // Every variant of one set of shader files, keyed by normalized ShaderFeature bits
+    struct ShaderPermutations
+    {
+        const char* name;
+        std::vector<ShaderStage> stages;
+        std::map<unsigned, GpuHandle> variants; // 0 until the variant first links
+        std::string defines;                 // Added to every variant ahead of the feature defines
+    };
+
+    // Collects named statistics and reports them once per interval
+    struct Profiler
+    {
+        std::map<std::string, double> values;
+        double reportInterval = 2.0;
+        double lastReport = 0.0;
+    };
+
+    // Which renderer draws the scene
+    enum RenderBackend
+    {
+        RENDER_BACKEND_OPENGL,
+        RENDER_BACKEND_SOFTWARE // CPU rasterizer; renders one frame to a file without a GL context
+    };
+
+    // Command line options
+    struct RunOptions
+    {
+        RenderBackend backend = RENDER_BACKEND_OPENGL;
+        const char* outputFile = nullptr;       // Image written by the software backend
+        const char* comparePrefix = nullptr;    // Render one GL frame, diff it against the software backend and exit
+        int threadCount = 0;                    // Software rasterizer threads; 0 uses every core
+        bool isRenderOnDemand = false;          // Start with render-on-demand on
+        const char* captureTarget = nullptr;    // Record rendered frames; see UCreateCapture
+        bool isOffscreen = false;               // Render on a hidden window
+        int frameCount = 0;                     // Quit after this many rendered frames; 0 runs until closed
+    };
+
+    // Vertex after the vertex stage, in the same spaces surface.vert outputs
+    struct SoftwareVertex
+    {
+        glm::vec4 clipPosition;
+        glm::vec3 worldPosition;
+        glm::vec3 normal;
+        glm::vec2 textureCoordinate;
+    };
+
+    // Screen-space triangle, ready to rasterize. Edge i is opposite vertex i: A x + B y + C is
+    // positive inside, and divided by twice the area it is the barycentric weight of vertex i.
+    struct SoftwareTriangle
+    {
+        float edgeA[3];
+        float edgeB[3];
+        float edgeC[3];
+        bool isTopLeft[3];      // Fill rule: pixel centers exactly on these edges are inside
+        float inverseArea;
+        float depth[3];         // Window depth, [0, 1]
+        float inverseW[3];      // For perspective-correct attributes
+        SoftwareVertex vertices[3];
+        int minX, minY, maxX, maxY; // Pixel bounds, clamped to the target
+        const Material* material;
+    };
+
+    // CPU color and depth buffer; RGBA8 with red in the low byte, bottom row first like a GL framebuffer
+    struct SoftwareTarget
+    {
+        int width = 0;
+        int height = 0;
+        std::vector<uint32_t> color;
+        std::vector<float> depth;
+    };
+
+    // CPU copy of a material texture, top level only
+    struct SoftwareTexture
+    {
+        int width = 0;
+        int height = 0;
+        std::vector<uint32_t> texels;
+    };
+
+    // One set of binned triangles drawn into one target
+    struct SoftwarePass
+    {
+        SoftwareTarget* target = nullptr;
+        const std::vector<SoftwareTriangle>* triangles = nullptr;
+        const std::vector<std::vector<uint32_t>>* bins = nullptr; // Triangle indices per tile, in submission order
+        int tilesX = 0;
+        int tilesY = 0;
+        bool isLightDistance = false;   // Shadow pass: depth is the distance to eyePosition, like shadow.frag
+        glm::vec3 eyePosition;          // Camera, or the light for a shadow pass
+    };
+
+    // Tile-based CPU rasterizer. Tiles are handed out to the worker threads (and the calling thread)
+    // through an atomic counter; every pixel of a tile is owned by one thread, so there are no locks per pixel.
+    struct SoftwareRenderer
+    {
+        std::vector<std::thread> workers;
+        std::mutex mutex;
+        std::condition_variable wake;       // A new pass, or shutdown
+        std::condition_variable finished;   // The last worker is done with the pass
+        unsigned generation = 0;
+        int activeWorkers = 0;
+        bool isStopping = false;
+        std::atomic<int> nextTile{ 0 };
+        const SoftwarePass* pass = nullptr;
+
+        std::vector<SoftwareTriangle> triangles;
+        std::vector<std::vector<uint32_t>> bins;
+
+        // Point light shadow cube faces, kept while the light and the casters don't move
+        SoftwareTarget shadowFaces[6];
+        bool isShadowValid = false;
+        glm::vec3 shadowLightPosition;
+        std::vector<glm::mat4> shadowCasters;
+
+        std::map<const Material*, SoftwareTexture> textures;
+    };
+
+    // Result of comparing two images
+    struct ImageDiff
+    {
+        double meanError = 0.0;     // Per channel, in 8 bit steps
+        int maxError = 0;
+        double mismatchRatio = 0.0; // Pixels with a channel off by more than IMAGE_DIFF_TOLERANCE
+    };
+
+    // How captured frames are written
+    enum CaptureFormat
+    {
+        CAPTURE_PNG,        // One PNG file per frame
+        CAPTURE_YUV_FILE,   // Raw I420 frames appended to one file
+        CAPTURE_YUV_PIPE    // Raw I420 frames written to the stdin of an external encoder
+    };
+
+    // One pixel pack buffer of the readback ring
+    struct CaptureSlot
+    {
+        GpuHandle pbo;
+        size_t bytes = 0;           // Allocated size
+        GLsync fence = nullptr;     // Signalled when the readback into pbo has finished
+        int width = 0;
+        int height = 0;
+        unsigned long long frame = 0;
+        bool isPending = false;
+    };
+
+    // A frame copied out of its PBO, waiting for an encoder thread
+    struct CaptureFrame
+    {
+        std::vector<uint32_t> pixels;   // RGBA8, bottom row first
+        int width = 0;
+        int height = 0;
+        unsigned long long frame = 0;   // Rendered frame number, used in PNG file names
+        unsigned long long sequence = 0; // Order in the output stream
+    };
+
+    // Captures rendered frames without stalling the render thread: readbacks go through a ring of
+    // PBOs fenced and mapped CAPTURE_RING_SIZE frames later, and encoding runs on worker threads.
+    // When either stage falls behind, frames are dropped instead of waited for.
+    struct CaptureSystem
+    {
+        bool isEnabled = false;
+        CaptureFormat format = CAPTURE_PNG;
+        std::string target;                 // PNG file name pattern, YUV file or encoder command
+        bool isSingleFile = false;          // PNG pattern without a frame number; every frame overwrites it
+        FILE* stream = nullptr;             // YUV file or pipe
+        int streamWidth = 0;                // A YUV stream keeps the size of its first frame
+        int streamHeight = 0;
+
+        CaptureSlot slots[CAPTURE_RING_SIZE];
+        int nextSlot = 0;
+        unsigned long long frame = 0;
+
+        std::vector<std::thread> workers;
+        std::mutex mutex;
+        std::condition_variable wake;       // A frame was queued, or shutdown
+        std::deque<CaptureFrame> queue;
+        std::vector<std::vector<uint32_t>> freeBuffers; // Pixel storage handed back by the workers
+        unsigned long long nextSequence = 0;
+        bool isStopping = false;
+
+        // Stream and single-file writes happen in sequence order even though frames are encoded in parallel
+        std::mutex writeMutex;
+        std::condition_variable writeTurn;
+        unsigned long long nextWrite = 0;
+
+        // Statistics over the profiler report interval; the worker counters are guarded by mutex
+        double windowStart = 0.0;
+        unsigned readbacks = 0;
+        unsigned droppedReadback = 0;   // Every PBO still in flight
+        unsigned droppedQueue = 0;      // Encoders behind
+        unsigned droppedSize = 0;       // Frame size differs from the YUV stream
+        unsigned encoded = 0;
+        unsigned failed = 0;
+        double encodeTime = 0.0;
+        size_t bytesWritten = 0;
+        unsigned droppedShutdown = 0;   // Readbacks still unfinished when capture stopped
     };
 
+    // Every GL object, with its size; declared first so it outlives every handle
+    GpuResourceRegistry gGpuResources;
+    // Command line options
+    RunOptions gRunOptions;
+    // Frame capture
+    CaptureSystem gCapture;
     // Main GLFW window
     GLFWwindow* gWindow = nullptr;
+    // Background logger
+    AsyncLogger gLogger;
     // Triangle mesh data
     GLMesh gMesh;
     GLMesh gCylinder;
     GLMesh gSphere;
+    SceneGeometry gSceneGeometry;
     // Shader programs
-    GLuint gCubeProgramId;
-    GLuint gLampProgramId;
-
-    // Texture
-    GLuint gTextureId;
-    glm::vec2 gUVScale(5.0f, 5.0f);
-    GLint gTexWrapMode = GL_REPEAT;
+    ShaderPermutations gSurfaceShader = { "surface", { { GL_VERTEX_SHADER, "surface.vert" }, { GL_FRAGMENT_SHADER, "surface.frag" } } };
+    GpuHandle gHiZCopyProgramId;
+    GpuHandle gHiZReduceProgramId;
+    GpuHandle gCullProgramId;
+    GpuHandle gShadowProgramId;
+    GpuHandle gUpscaleProgramId;
+    ShaderManager gShaderManager;
+
+    // Scene objects, rebuilt every frame and ordered by draw batch
+    std::vector<SceneObject> gSceneObjects;
+    std::vector<DrawBatch> gDrawBatches;
+
+    // Offscreen scene target and framebuffer size
+    RenderTarget gSceneTarget;
+    int gFramebufferWidth = WINDOW_WIDTH;
+    int gFramebufferHeight = WINDOW_HEIGHT;
+
+    // Occlusion culling
+    OcclusionCuller gCuller;
+
+    // Dynamic resolution
+    DynamicResolution gDynamicResolution;
+
+    // Frame statistics
+    Profiler gProfiler;
+
+    // Point light shadows
+    ShadowCache gShadow;
+    int gShadowPcfSamples = 20; // Percentage-closer filtering taps: 1 (hard), 8 or 20
+
+    // Texture wrapping of gTexturedMaterial, requested by input and applied by the render phase
+    GLint gPendingTexWrapMode = GL_REPEAT;
+
+    // input
+    std::vector<InputEvent> gInputEvents; // Filled by the GLFW callbacks, drained by UProcessInput
+    InputAction gKeyActions[GLFW_KEY_LAST + 1] = {};
+    bool gIsActionHeld[ACTION_COUNT] = {};
+    int gHeldActionCount = 0;
+    InputLatency gInputLatency;
 
     // camera
     Camera gCamera(glm::vec3(0.0f, 0.0f, 7.0f));
@@ -58,8 +963,9 @@ namespace
     bool gFirstMouse = true;
 
     // timing
-    float gDeltaTime = 0.0f; // time between current frame and last frame
-    float gLastFrame = 0.0f;
+    float gDeltaTime = 0.0f; // smoothed time between current frame and last frame
+    FramePacer gFramePacer;
+    RedrawTracker gRedraw;
 
     // Subject position and scale
     glm::vec3 gRectanglePosition(0.0f, 0.0f, 0.0f);
@@ -73,6 +979,18 @@ namespace
     glm::vec3 gLightPosition(2.0f, 1.0f, 3.0f);
     glm::vec3 gLightScale(5.0f);
 
+    // Second light source (drawn with the lamp program)
+    glm::vec3 gSecondLightPosition(0.0f, 1.5f, 1.0f);
+    glm::vec3 gSecondLightColor(0.0f, 1.0f, 0.0f);
+    glm::vec3 gSecondLightScale(0.05f);
+
+    // Materials; the UV scale and wrap mode keys edit gTexturedMaterial
+    Material gTexturedMaterial = { SHADER_FEATURE_TEXTURED | SHADER_FEATURE_LIT | SHADER_FEATURE_SPECULAR, glm::vec3(1.0f),
+        "../../resources/textures/smiley.png", glm::vec2(5.0f, 5.0f) };
+    Material gPlainMaterial = { SHADER_FEATURE_LIT | SHADER_FEATURE_SPECULAR, gObjectColor };
+    Material gLampMaterial = { 0, glm::vec3(1.0f) }; // Unlit white
+    MaterialSystem gMaterials;
+
     // Cylinder position and scale
     glm::vec3 gCylinderPosition(0.0f, 0.0f, 0.0f); // Update the position as per your requirement
     glm::vec3 gCylinderScale(1.0f, 2.0f, 1.0f); // Update the scale as per your requirement
@@ -90,125 +1008,135 @@ namespace
  * and render graphics on the screen
  */
 bool UInitialize(int, char* [], GLFWwindow** window);
+void UShutdown();
 void UResizeWindow(GLFWwindow* window, int width, int height);
+void URefreshWindow(GLFWwindow* window);
 void UProcessInput(GLFWwindow* window);
 void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos);
 void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset);
 void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
+void UKeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods);
+void UHandleMouseMovement(double xpos, double ypos);
+void UHandleMouseButton(int button, int action);
+void UTriggerAction(GLFWwindow* window, InputAction action);
+void UApplyHeldActions();
+void UApplyPendingRenderState();
+void ULogWrapMode(GLint wrapMode);
+void UMarkInputLatency(double eventTime);
+void UPresentInputLatency();
 void UCreateMesh(GLMesh& mesh, GLMesh& cylinder, GLMesh& sphere);
-void UDestroyMesh(GLMesh& mesh);
-bool UCreateTexture(const char* filename, GLuint& textureId);
-void UDestroyTexture(GLuint textureId);
-void URender();
-bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId);
-void UDestroyShaderProgram(GLuint programId);
-
-
-/* Cube Vertex Shader Source Code*/
-const GLchar* cubeVertexShaderSource = GLSL(440,
-
-    layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
-layout(location = 1) in vec3 normal; // VAP position 1 for normals
-layout(location = 2) in vec2 textureCoordinate;
-
-out vec3 vertexNormal; // For outgoing normals to fragment shader
-out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
-out vec2 vertexTextureCoordinate;
-
-//Uniform / Global variables for the  transform matrices
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
-
-void main()
-{
-    gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
-
-    vertexFragmentPos = vec3(model * vec4(position, 1.0f)); // Gets fragment / pixel position in world space only (exclude view and projection)
-
-    vertexNormal = mat3(transpose(inverse(model))) * normal; // get normal vectors in world space only and exclude normal translation properties
-    vertexTextureCoordinate = textureCoordinate;
-}
-);
-
-/* Cube Fragment Shader Source Code*/
-const GLchar* cubeFragmentShaderSource = GLSL(440,
-
-    in vec3 vertexNormal; // For incoming normals
-in vec3 vertexFragmentPos; // For incoming fragment position
-in vec2 vertexTextureCoordinate;
-
-out vec4 fragmentColor; // For outgoing cube color to the GPU
-
-// Uniform / Global variables for object color, light color, light position, and camera/view position
-uniform vec3 objectColor;
-uniform vec3 lightColor;
-uniform vec3 lightPos;
-uniform vec3 viewPosition;
-uniform sampler2D uTexture; // Useful when working with multiple textures
-uniform vec2 uvScale;
-
-
-void main()
-{
-    /*Phong lighting model calculations to generate ambient, diffuse, and specular components*/
-
-    //Calculate Ambient lighting*/
-    float ambientStrength = 0.1f; // Set ambient or global lighting strength
-    vec3 ambient = ambientStrength * lightColor; // Generate ambient light color
-
-    //Calculate Diffuse lighting*/
-    vec3 norm = normalize(vertexNormal); // Normalize vectors to 1 unit
-    vec3 lightDirection = normalize(lightPos - vertexFragmentPos); // Calculate distance (light direction) between light source and fragments/pixels on cube
-    float impact = max(dot(norm, lightDirection), 0.0);// Calculate diffuse impact by generating dot product of normal and light
-    vec3 diffuse = impact * lightColor; // Generate diffuse light color
-
-    //Calculate Specular lighting*/
-    float specularIntensity = 0.8f; // Set specular light strength
-    float highlightSize = 16.0f; // Set specular highlight size
-    vec3 viewDir = normalize(viewPosition - vertexFragmentPos); // Calculate view direction
-    vec3 reflectDir = reflect(-lightDirection, norm);// Calculate reflection vector
-    //Calculate specular component
-    float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
-    vec3 specular = specularIntensity * specularComponent * lightColor;
-
-    // Texture holds the color to be used for all three components
-    vec4 textureColor = texture(uTexture, vertexTextureCoordinate * uvScale);
-
-    // Calculate phong result
-    vec3 phong = (ambient + diffuse + specular) * textureColor.xyz;
-
-    fragmentColor = vec4(phong, 1.0); // Send lighting results to GPU
-}
-);
-
-/* Lamp Shader Source Code*/
-const GLchar* lampVertexShaderSource = GLSL(440,
-
-    layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
-
-//Uniform / Global variables for the  transform matrices
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
-
-void main()
-{
-    gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
-}
-);
-
-
-/* Fragment Shader Source Code*/
-const GLchar* lampFragmentShaderSource = GLSL(440,
-
-    out vec4 fragmentColor; // For outgoing lamp color (smaller cube) to the GPU
-
-void main()
-{
-    fragmentColor = vec4(1.0f); // Set color to white (1.0f,1.0f,1.0f) with alpha 1.0
-}
-);
+void UCreateSceneGeometry(SceneGeometry& geometry, const std::vector<GLMesh*>& meshes);
+void UReserveObjectIndices(SceneGeometry& geometry, size_t objectCount);
+void UDestroySceneGeometry(SceneGeometry& geometry);
+bool UCreateMaterials(MaterialSystem& system);
+void UDestroyMaterials(MaterialSystem& system);
+bool UCreateTextureArrays(MaterialSystem& system);
+GLuint UGetSampler(MaterialSystem& system, GLint wrapMode);
+void UResolveMaterialTexture(MaterialSystem& system, Material& material);
+void UUploadMaterials(MaterialSystem& system);
+void UBindMaterials(const MaterialSystem& system);
+bool URender();
+bool UReadTextFile(const std::string& path, std::string& text);
+void UCreateShaderManager(ShaderManager& manager);
+void UDestroyShaderManager(ShaderManager& manager);
+void UAddShaderProgram(ShaderManager& manager, const char* name, const std::vector<ShaderStage>& stages, GpuHandle& programId, const std::string& defines = "");
+bool USubmitShaderProgram(ManagedProgram& program);
+bool UPollShaderProgram(const ShaderManager& manager, ManagedProgram& program, bool wait);
+bool UWaitForShaderPrograms(ShaderManager& manager);
+void UUpdateShaderManager(ShaderManager& manager);
+unsigned UNormalizeShaderFeatures(unsigned features);
+GLuint UGetShaderVariant(ShaderManager& manager, ShaderPermutations& permutations, unsigned features);
+void UCreateRenderTarget(RenderTarget& target, int width, int height);
+void UDestroyRenderTarget(RenderTarget& target);
+void UCreateOcclusionCuller(OcclusionCuller& culler, int width, int height);
+void UReserveOcclusionCuller(OcclusionCuller& culler, size_t objectCount);
+void UDestroyOcclusionCuller(OcclusionCuller& culler);
+void UBuildSceneObjects();
+void UUpdateSceneObjects();
+void UBuildDrawBatches();
+void UDrawSceneObjects(GLuint commandBuffer, GLuint countBuffer, const glm::mat4& view, const glm::mat4& projection);
+void UBuildHiZ();
+void UCullSceneObjects(const glm::mat4& viewProjection);
+void UCollectCullingStats();
+void UCreateShadowCache(ShadowCache& shadow);
+void UDestroyShadowCache(ShadowCache& shadow);
+void UUpdateShadowCache(ShadowCache& shadow);
+void UDrawShadowCasters(GLuint fbo, bool isStatic);
+void ULogStart();
+void ULogStop();
+void ULog(int level, const char* format, ...);
+bool ULogAllow(LogRateLimiter& limiter);
+void ULogWorker();
+void USetPresentMode(FramePacer& pacer, PresentMode mode);
+void USetFrameRateLimit(FramePacer& pacer, double framesPerSecond);
+void UWaitUntil(double time);
+double UBeginFrame(FramePacer& pacer);
+bool UIsAnimating();
+bool UNeedsRedraw(const RedrawTracker& tracker);
+void UWaitForChanges(RedrawTracker& tracker, FramePacer& pacer);
+void UReportRedrawStats(RedrawTracker& tracker, double currentTime);
+void UCreateDynamicResolution(DynamicResolution& resolution);
+void UDestroyDynamicResolution(DynamicResolution& resolution);
+void UUpdateDynamicResolution(DynamicResolution& resolution, RenderTarget& target, bool forceFullResolution);
+void UBeginGpuFrameTimer(DynamicResolution& resolution);
+void UEndGpuFrameTimer(DynamicResolution& resolution);
+void UUpscaleToWindow(const DynamicResolution& resolution, const RenderTarget& target);
+void UProfilerSet(const char* name, double value);
+size_t UGpuTextureBytes(const GpuTextureDesc& desc);
+void UTrackGpuResource(GpuResourceRegistry& registry, GpuResourceType type, GLuint id, const GpuResourceInfo& info);
+GpuResourceInfo UUntrackGpuResource(GpuResourceRegistry& registry, GpuResourceType type, GLuint id);
+GpuHandle UCreateGpuBuffer(GpuResourceRegistry& registry, GLenum target, size_t bytes, const void* data, GLenum usage, const char* label);
+void UResizeGpuBuffer(GpuResourceRegistry& registry, GLuint bufferId, GLenum target, size_t bytes, const void* data, GLenum usage);
+GpuHandle UCreateGpuTexture(GpuResourceRegistry& registry, const GpuTextureDesc& desc, const char* label);
+GpuHandle UCreateGpuObject(GpuResourceRegistry& registry, GpuResourceType type, const char* label);
+void UMarkGpuResourceUnpoolable(GpuResourceRegistry& registry, GpuResourceType type, GLuint id);
+void UReleaseGpuResource(GpuResourceRegistry& registry, GpuResourceType type, GLuint id);
+void UTrimGpuResourcePools(GpuResourceRegistry& registry, unsigned long long olderThanFrame);
+void UUpdateGpuResources(GpuResourceRegistry& registry);
+size_t UDestroyGpuResourceRegistry(GpuResourceRegistry& registry);
+void UProfilerReport(double currentTime);
+bool UParseArguments(int argc, char* argv[], RunOptions& options);
+glm::mat4 UGetProjection();
+int URunSoftwareBackend(const RunOptions& options);
+int UCompareBackends(const char* prefix);
+void UReadRenderTarget(const RenderTarget& target, std::vector<uint32_t>& pixels);
+ImageDiff UCompareImages(const std::vector<uint32_t>& first, const std::vector<uint32_t>& second, std::vector<uint32_t>& diffPixels);
+bool UWritePpm(const char* path, const std::vector<uint32_t>& pixels, int width, int height);
+bool UCreateSoftwareRenderer(SoftwareRenderer& renderer, const std::vector<Material*>& materials, int threadCount);
+void UDestroySoftwareRenderer(SoftwareRenderer& renderer);
+void USoftwareWorker(SoftwareRenderer* renderer);
+void URunSoftwarePass(SoftwareRenderer& renderer, const SoftwarePass& pass);
+void URunSoftwareTiles(SoftwareRenderer& renderer, const SoftwarePass& pass);
+void URenderSoftware(SoftwareRenderer& renderer, SoftwareTarget& target, const glm::mat4& view, const glm::mat4& projection);
+void URenderSoftwareShadows(SoftwareRenderer& renderer);
+void USetupSoftwareTriangles(SoftwareRenderer& renderer, const GLMesh& mesh, const glm::mat4& model, const glm::mat4& viewProjection,
+    const SoftwareTarget& target, const Material* material);
+void UAddSoftwareTriangle(SoftwareRenderer& renderer, const SoftwareVertex& v0, const SoftwareVertex& v1, const SoftwareVertex& v2,
+    const SoftwareTarget& target, const Material* material);
+void UBinSoftwareTriangles(SoftwareRenderer& renderer, SoftwarePass& pass);
+int USoftwareQuadCoverage(const SoftwareTriangle& triangle, int x, int y, float edges[3][4]);
+void USoftwareRasterizeTile(const SoftwareRenderer& renderer, const SoftwarePass& pass, int tile);
+void UShadeSoftwarePixel(const SoftwareRenderer& renderer, const SoftwarePass& pass, const SoftwareTriangle& triangle, const float weights[3], size_t pixel);
+bool UShadeSoftwareFragment(const SoftwareRenderer& renderer, const SoftwarePass& pass, const Material& material, const SoftwareVertex& fragment, glm::vec4& color);
+float USoftwareShadowFactor(const SoftwareRenderer& renderer, const SoftwarePass& pass, const glm::vec3& fragmentPosition);
+float USampleSoftwareShadow(const SoftwareRenderer& renderer, const glm::vec3& direction);
+int UWrapTexel(int coordinate, int size, GLint wrapMode);
+glm::vec4 USampleSoftwareTexture(const SoftwareTexture& texture, const glm::vec2& textureCoordinate, GLint wrapMode);
+bool UIsValidCapturePattern(const char* target);
+bool UHasCaptureFrameNumber(const char* pattern);
+bool UCreateCapture(CaptureSystem& capture, const char* target);
+void UDestroyCapture(CaptureSystem& capture);
+void UCaptureFrame(CaptureSystem& capture, const RenderTarget& target, double currentTime);
+void UCollectCaptureSlots(CaptureSystem& capture, bool wait);
+void UQueueCaptureFrame(CaptureSystem& capture, const CaptureSlot& slot);
+void UCaptureWorker(CaptureSystem* capture);
+bool UWriteCaptureFrame(CaptureSystem& capture, const CaptureFrame& frame, std::vector<unsigned char>& encoded);
+bool UWriteCapturePng(const CaptureSystem& capture, const CaptureFrame& frame, const std::vector<unsigned char>& encoded);
+void UConvertToI420(const CaptureFrame& frame, std::vector<unsigned char>& yuv);
+uint32_t UCrc32(const unsigned char* data, size_t length, uint32_t crc);
+void UAppendPngChunk(std::vector<unsigned char>& png, const char* type, const unsigned char* data, size_t length);
+void UEncodePng(const CaptureFrame& frame, std::vector<unsigned char>& png);
+void UReportCaptureStats(CaptureSystem& capture, double currentTime);
 
 
 // Images are loaded with Y axis going down, but OpenGL's Y axis goes up, so let's flip it
@@ -233,65 +1161,202 @@ void flipImageVertically(unsigned char* image, int width, int height, int channe
 
 int main(int argc, char* argv[])
 {
+    ULogStart();
+
+    if (!UParseArguments(argc, argv, gRunOptions))
+    {
+        ULogStop();
+        return EXIT_FAILURE;
+    }
+
+    // Both backends shade with the same materials
+    gMaterials.materials = { &gTexturedMaterial, &gPlainMaterial, &gLampMaterial };
+
+    // The software backend needs neither a window nor a GL context
+    if (gRunOptions.backend == RENDER_BACKEND_SOFTWARE)
+    {
+        int status = URunSoftwareBackend(gRunOptions);
+        ULogStop();
+        return status;
+    }
+
     if (!UInitialize(argc, argv, &gWindow))
+    {
+        ULogStop();
         return EXIT_FAILURE;
+    }
+
+    // Start compiling the shader programs; they build in the background while the rest of the scene loads
+    UCreateShaderManager(gShaderManager);
+    UAddShaderProgram(gShaderManager, "upscale", { { GL_VERTEX_SHADER, "upscale.vert" }, { GL_FRAGMENT_SHADER, "upscale.frag" } }, gUpscaleProgramId);
+    UAddShaderProgram(gShaderManager, "shadow", { { GL_VERTEX_SHADER, "shadow.vert" }, { GL_GEOMETRY_SHADER, "shadow.geom" }, { GL_FRAGMENT_SHADER, "shadow.frag" } }, gShadowProgramId);
+
+    // Occlusion culling programs
+    UAddShaderProgram(gShaderManager, "hiZCopy", { { GL_COMPUTE_SHADER, "hiz_copy.comp" } }, gHiZCopyProgramId);
+    UAddShaderProgram(gShaderManager, "hiZReduce", { { GL_COMPUTE_SHADER, "hiz_reduce.comp" } }, gHiZReduceProgramId);
+    UAddShaderProgram(gShaderManager, "cull", { { GL_COMPUTE_SHADER, "cull.comp" } }, gCullProgramId);
+
+    // Bindless handles let every draw reach its texture without binding it
+    gMaterials.hasBindless = GLEW_ARB_bindless_texture != 0;
+    if (gMaterials.hasBindless)
+        gSurfaceShader.defines = "#define BINDLESS\n";
+
+    // Draw counts read from a buffer let the cull pass pack the visible commands together
+    gCuller.hasIndirectCount = GLEW_ARB_indirect_parameters != 0;
+
+    // Surface variants used by the scene's materials; any other combination compiles when first drawn
+    UGetShaderVariant(gShaderManager, gSurfaceShader, gTexturedMaterial.features);
+    UGetShaderVariant(gShaderManager, gSurfaceShader, gPlainMaterial.features);
+    UGetShaderVariant(gShaderManager, gSurfaceShader, gLampMaterial.features);
 
     // Create the mesh
-    UCreateMesh(gMesh, gCylinder, gSphere); // Calls the function to create the Vertex Buffer Object
+    UCreateMesh(gMesh, gCylinder, gSphere);
+    UCreateSceneGeometry(gSceneGeometry, { &gMesh, &gCylinder, &gSphere }); // Creates the Vertex Buffer Objects
 
-    // Create the shader programs
-    if (!UCreateShaderProgram(cubeVertexShaderSource, cubeFragmentShaderSource, gCubeProgramId))
+    // Load the material textures
+    if (!UCreateMaterials(gMaterials))
+    {
+        UShutdown();
         return EXIT_FAILURE;
+    }
+
+    // Samplers pick their texture units with layout(binding) in the shaders: shadowMap is unit 1,
+    // the material texture arrays start at MATERIAL_TEXTURE_UNIT
+
+    UCreateShadowCache(gShadow);
+    UCreateDynamicResolution(gDynamicResolution);
+
+    // The comparison needs the full-resolution frame, and captured frames have to keep one size
+    if (gRunOptions.comparePrefix || gRunOptions.captureTarget)
+        gDynamicResolution.isEnabled = false;
 
-    if (!UCreateShaderProgram(lampVertexShaderSource, lampFragmentShaderSource, gLampProgramId))
+    // Every program has to be ready before the first frame
+    if (!UWaitForShaderPrograms(gShaderManager))
+    {
+        UShutdown();
         return EXIT_FAILURE;
+    }
 
-    // Load texture
-    const char* texFilename = "../../resources/textures/smiley.png";
-    if (!UCreateTexture(texFilename, gTextureId))
+    // Last, so no encoder thread is running yet if anything above fails
+    if (gRunOptions.captureTarget && !UCreateCapture(gCapture, gRunOptions.captureTarget))
     {
-        cout << "Failed to load texture " << texFilename << endl;
+        UShutdown();
         return EXIT_FAILURE;
     }
-    // tell opengl for each sampler to which texture unit it belongs to (only has to be done once)
-    glUseProgram(gCubeProgramId);
-    // We set the texture as texture unit 0
-    glUniform1i(glGetUniformLocation(gCubeProgramId, "uTexture"), 0);
 
     // Sets the background color of the window to black (it will be implicitely used by glClear)
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 
-    // render loop
-    // -----------
+    // Frame pacing: vsync by default, deadlines follow the monitor refresh rate
+    const GLFWvidmode* videoMode = glfwGetVideoMode(glfwGetPrimaryMonitor());
+    if (videoMode && videoMode->refreshRate > 0)
+        gFramePacer.refreshPeriod = 1.0 / videoMode->refreshRate;
+    // A hidden window has no display to wait for
+    USetPresentMode(gFramePacer, gRunOptions.isOffscreen ? PRESENT_UNCAPPED : PRESENT_VSYNC);
+    gFramePacer.frameStart = glfwGetTime();
+    gFramePacer.windowStart = gFramePacer.frameStart;
+
+    // Render-on-demand skips frames that would look the same as the last one
+    gRedraw.isOnDemand = gRunOptions.isRenderOnDemand;
+    gRedraw.windowStart = gFramePacer.frameStart;
+
+    int exitStatus = EXIT_SUCCESS;
+    int renderedFrames = 0;
+
+    // render loop
+    // -----------
     while (!glfwWindowShouldClose(gWindow))
     {
-        // per-frame timing
+        // Going idle on a reduced render scale would leave an upscaled frame on screen indefinitely
+        if (!UNeedsRedraw(gRedraw) && gDynamicResolution.isEnabled && gDynamicResolution.scale < gDynamicResolution.maxScale)
+            gRedraw.dirty |= REDRAW_FULL_RESOLUTION;
+
+        // Nothing changed and nothing is moving: sleep until an event arrives or the idle timeout
+        if (!UNeedsRedraw(gRedraw))
+        {
+            UWaitForChanges(gRedraw, gFramePacer);
+            UProcessInput(gWindow);
+            UUpdateShaderManager(gShaderManager);
+
+            double now = glfwGetTime();
+            UReportRedrawStats(gRedraw, now);
+            UProfilerReport(now);
+            continue;
+        }
+
+        // per-frame timing (waits out the frame limiter)
         // --------------------
-        float currentFrame = glfwGetTime();
-        gDeltaTime = currentFrame - gLastFrame;
-        gLastFrame = currentFrame;
+        double currentFrame = UBeginFrame(gFramePacer);
 
-        // input
+        // input: gather this frame's events before acting on them
         // -----
+        glfwPollEvents();
         UProcessInput(gWindow);
 
+        // Swap in shaders that finished compiling after a file change
+        UUpdateShaderManager(gShaderManager);
+
         // Render this frame
-        URender();
+        bool isDrawn = URender();
+        gRedraw.dirty = 0;
+        ++gRedraw.activeFrames;
 
-        glfwPollEvents();
+        // Compare mode: diff the first frame against the software backend, then quit
+        if (gRunOptions.comparePrefix)
+        {
+            exitStatus = UCompareBackends(gRunOptions.comparePrefix);
+            glfwSetWindowShouldClose(gWindow, GLFW_TRUE);
+        }
+
+        // Start reading this frame back; earlier readbacks that have landed go to the encoders.
+        // A minimized window leaves the scene target holding an old frame.
+        if (isDrawn)
+            UCaptureFrame(gCapture, gSceneTarget, currentFrame);
+
+        if (gRunOptions.frameCount > 0 && ++renderedFrames >= gRunOptions.frameCount)
+            glfwSetWindowShouldClose(gWindow, GLFW_TRUE);
+
+        UUpdateGpuResources(gGpuResources);
+        UReportRedrawStats(gRedraw, currentFrame);
+        UProfilerReport(currentFrame);
     }
 
+    UShutdown();
+
+    exit(exitStatus); // Terminates the program
+}
+
+
+// Releases everything main created and closes the window. Every exit after UInitialize goes through
+// here, so the leak report covers the error paths too.
+void UShutdown()
+{
+    // Write out the frames still being captured
+    UDestroyCapture(gCapture);
+
     // Release mesh data
-    UDestroyMesh(gMesh);
+    UDestroySceneGeometry(gSceneGeometry);
+
+    // Release the scene target and culling buffers
+    UDestroyRenderTarget(gSceneTarget);
+    UDestroyOcclusionCuller(gCuller);
+    UDestroyShadowCache(gShadow);
+    UDestroyDynamicResolution(gDynamicResolution);
 
     // Release texture
-    UDestroyTexture(gTextureId);
+    UDestroyMaterials(gMaterials);
 
     // Release shader programs
-    UDestroyShaderProgram(gCubeProgramId);
-    UDestroyShaderProgram(gLampProgramId);
+    UDestroyShaderManager(gShaderManager);
 
-    exit(EXIT_SUCCESS); // Terminates the program successfully
+    // Everything has been destroyed by now; whatever the registry still holds is a leak
+    UDestroyGpuResourceRegistry(gGpuResources);
+
+    glfwDestroyWindow(gWindow);
+    gWindow = nullptr;
+    glfwTerminate();
+
+    ULogStop();
 }
 
 
@@ -305,6 +1370,10 @@ bool UInitialize(int argc, char* argv[], GLFWwindow** window)
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 4);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
+    // Comparison and offscreen runs don't show the window
+    if (gRunOptions.comparePrefix || gRunOptions.isOffscreen)
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
 #ifdef __APPLE__
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 #endif
@@ -314,15 +1383,22 @@ bool UInitialize(int argc, char* argv[], GLFWwindow** window)
     * window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, NULL, NULL);
     if (*window == NULL)
     {
-        std::cout << "Failed to create GLFW window" << std::endl;
+        ULOG_ERROR("Failed to create GLFW window");
         glfwTerminate();
         return false;
     }
     glfwMakeContextCurrent(*window);
+    glfwGetFramebufferSize(*window, &gFramebufferWidth, &gFramebufferHeight);
     glfwSetFramebufferSizeCallback(*window, UResizeWindow);
+    glfwSetWindowRefreshCallback(*window, URefreshWindow);
     glfwSetCursorPosCallback(*window, UMousePositionCallback);
     glfwSetScrollCallback(*window, UMouseScrollCallback);
     glfwSetMouseButtonCallback(*window, UMouseButtonCallback);
+    glfwSetKeyCallback(*window, UKeyCallback);
+
+    // Build the key to action lookup from the binding table
+    for (const KeyBinding& binding : KEY_BINDINGS)
+        gKeyActions[binding.key] = binding.action;
 
     // tell GLFW to capture our mouse
     glfwSetInputMode(*window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
@@ -335,118 +1411,307 @@ bool UInitialize(int argc, char* argv[], GLFWwindow** window)
 
     if (GLEW_OK != GlewInitResult)
     {
-        std::cerr << glewGetErrorString(GlewInitResult) << std::endl;
+        ULOG_ERROR("%s", (const char*)glewGetErrorString(GlewInitResult));
+        glfwDestroyWindow(*window);
+        *window = NULL;
+        glfwTerminate();
         return false;
     }
 
     // Displays GPU OpenGL version
-    cout << "INFO: OpenGL Version: " << glGetString(GL_VERSION) << endl;
+    ULOG_INFO("OpenGL Version: %s", (const char*)glGetString(GL_VERSION));
 
     return true;
 }
 
 
-// process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly
+// Drains the input event queue into actions, then applies the actions that are held down.
+// With no events queued and nothing held this does no work.
 void UProcessInput(GLFWwindow* window)
 {
-    static const float cameraSpeed = 2.5f;
+    for (const InputEvent& event : gInputEvents)
+    {
+        switch (event.type)
+        {
+        case INPUT_EVENT_KEY:
+        {
+            // Key repeats carry no new state
+            if (event.action == GLFW_REPEAT || event.code < 0 || event.code > GLFW_KEY_LAST)
+                break;
 
-    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
+            InputAction action = gKeyActions[event.code];
+            if (action == ACTION_NONE)
+                break;
+
+            bool isPressed = event.action == GLFW_PRESS;
+            if (gIsActionHeld[action] != isPressed)
+            {
+                gIsActionHeld[action] = isPressed;
+                gHeldActionCount += isPressed ? 1 : -1;
+            }
+
+            if (isPressed)
+                UTriggerAction(window, action);
+
+            UMarkInputLatency(event.time);
+        }
+        break;
+
+        case INPUT_EVENT_CURSOR:
+            UHandleMouseMovement(event.x, event.y);
+            UMarkInputLatency(event.time);
+            break;
+
+        case INPUT_EVENT_SCROLL:
+            gCamera.ProcessMouseScroll(event.y);
+            gRedraw.dirty |= REDRAW_CAMERA;
+            UMarkInputLatency(event.time);
+            break;
+
+        case INPUT_EVENT_MOUSE_BUTTON:
+            UHandleMouseButton(event.code, event.action);
+            break;
+        }
+    }
+    gInputEvents.clear();
+
+    if (gHeldActionCount > 0)
+        UApplyHeldActions();
+}
+
+
+// Runs the one-shot part of an action when its key goes down
+void UTriggerAction(GLFWwindow* window, InputAction action)
+{
+    switch (action)
+    {
+    case ACTION_QUIT:
         glfwSetWindowShouldClose(window, true);
+        break;
+
+    // 2D / 3D
+    case ACTION_VIEW_2D:
+        isIn3DMode = false;
+        gRedraw.dirty |= REDRAW_SCENE;
+        break;
+    case ACTION_VIEW_3D:
+        isIn3DMode = true;
+        gRedraw.dirty |= REDRAW_SCENE;
+        break;
+
+    // Texture wrapping of the textured material is applied by the render phase
+    case ACTION_WRAP_REPEAT:
+        gPendingTexWrapMode = GL_REPEAT;
+        gRedraw.dirty |= REDRAW_MATERIALS;
+        break;
+    case ACTION_WRAP_MIRRORED_REPEAT:
+        gPendingTexWrapMode = GL_MIRRORED_REPEAT;
+        gRedraw.dirty |= REDRAW_MATERIALS;
+        break;
+    case ACTION_WRAP_CLAMP_TO_EDGE:
+        gPendingTexWrapMode = GL_CLAMP_TO_EDGE;
+        gRedraw.dirty |= REDRAW_MATERIALS;
+        break;
+    case ACTION_WRAP_CLAMP_TO_BORDER:
+        gPendingTexWrapMode = GL_CLAMP_TO_BORDER;
+        gRedraw.dirty |= REDRAW_MATERIALS;
+        break;
+
+    // Shadow filtering quality
+    case ACTION_SHADOW_PCF_1:
+    case ACTION_SHADOW_PCF_8:
+    case ACTION_SHADOW_PCF_20:
+    {
+        int samples = action == ACTION_SHADOW_PCF_1 ? 1 : action == ACTION_SHADOW_PCF_8 ? 8 : 20;
+        if (gShadowPcfSamples != samples)
+        {
+            gShadowPcfSamples = samples;
+            gRedraw.dirty |= REDRAW_LIGHTS;
+            ULOG_INFO("Shadow PCF samples: %d", samples);
+        }
+    }
+    break;
+
+    // Pause and resume lamp orbiting
+    case ACTION_LAMP_ORBIT:
+        gIsLampOrbiting = true;
+        gRedraw.dirty |= REDRAW_LIGHTS;
+        break;
+    case ACTION_LAMP_PAUSE:
+        gIsLampOrbiting = false;
+        gRedraw.dirty |= REDRAW_LIGHTS;
+        break;
+
+    // Frame pacing
+    case ACTION_PRESENT_VSYNC:
+        USetPresentMode(gFramePacer, PRESENT_VSYNC);
+        gRedraw.dirty |= REDRAW_SETTINGS;
+        break;
+    case ACTION_PRESENT_ADAPTIVE_VSYNC:
+        USetPresentMode(gFramePacer, PRESENT_ADAPTIVE_VSYNC);
+        gRedraw.dirty |= REDRAW_SETTINGS;
+        break;
+    case ACTION_PRESENT_UNCAPPED:
+        USetPresentMode(gFramePacer, PRESENT_UNCAPPED);
+        gRedraw.dirty |= REDRAW_SETTINGS;
+        break;
+    case ACTION_CYCLE_FRAME_RATE_LIMIT:
+    {
+        const int limitCount = sizeof(FRAME_RATE_LIMITS) / sizeof(FRAME_RATE_LIMITS[0]);
+        static int limitIndex = 0;
+        limitIndex = (limitIndex + 1) % limitCount;
+        USetFrameRateLimit(gFramePacer, FRAME_RATE_LIMITS[limitIndex]);
+        gRedraw.dirty |= REDRAW_SETTINGS;
+    }
+    break;
+
+    // Dynamic resolution
+    case ACTION_TOGGLE_DYNAMIC_RESOLUTION:
+        // A capture keeps one frame size; a resized frame would be dropped
+        if (gCapture.isEnabled)
+        {
+            ULOG_WARNING("Dynamic resolution stays off while capturing");
+            break;
+        }
+        gDynamicResolution.isEnabled = !gDynamicResolution.isEnabled;
+        gRedraw.dirty |= REDRAW_SETTINGS;
+        ULOG_INFO("Dynamic resolution: %s", gDynamicResolution.isEnabled ? "ON" : "OFF");
+        break;
+    case ACTION_TOGGLE_UPSCALE_FILTER:
+        gDynamicResolution.filter = gDynamicResolution.filter == UPSCALE_BILINEAR ? UPSCALE_SHARPENED : UPSCALE_BILINEAR;
+        gRedraw.dirty |= REDRAW_SETTINGS;
+        ULOG_INFO("Upscale filter: %s", gDynamicResolution.filter == UPSCALE_BILINEAR ? "BILINEAR" : "SHARPENED");
+        break;
+
+    // Render on demand
+    case ACTION_TOGGLE_RENDER_ON_DEMAND:
+        gRedraw.isOnDemand = !gRedraw.isOnDemand;
+        gRedraw.dirty = REDRAW_ALL;
+        ULOG_INFO("Render on demand: %s", gRedraw.isOnDemand ? "ON" : "OFF");
+        break;
+
+    default:
+        break;
+    }
+}
+
+
+// Applies the continuous actions (camera movement, UV scale) while their keys are held
+void UApplyHeldActions()
+{
+    if (gIsActionHeld[ACTION_MOVE_FORWARD] || gIsActionHeld[ACTION_MOVE_BACKWARD] || gIsActionHeld[ACTION_MOVE_LEFT] ||
+        gIsActionHeld[ACTION_MOVE_RIGHT] || gIsActionHeld[ACTION_MOVE_UP] || gIsActionHeld[ACTION_MOVE_DOWN])
+        gRedraw.dirty |= REDRAW_CAMERA;
 
-    if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
+    if (gIsActionHeld[ACTION_MOVE_FORWARD])
         gCamera.ProcessKeyboard(FORWARD, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
+    if (gIsActionHeld[ACTION_MOVE_BACKWARD])
         gCamera.ProcessKeyboard(BACKWARD, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
+    if (gIsActionHeld[ACTION_MOVE_LEFT])
         gCamera.ProcessKeyboard(LEFT, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
+    if (gIsActionHeld[ACTION_MOVE_RIGHT])
         gCamera.ProcessKeyboard(RIGHT, gDeltaTime);
 
     // Up
-    if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS)
+    if (gIsActionHeld[ACTION_MOVE_UP])
         gCamera.ProcessKeyboard(UP, gDeltaTime);
 
     // Down
-    if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS)
+    if (gIsActionHeld[ACTION_MOVE_DOWN])
         gCamera.ProcessKeyboard(DOWN, gDeltaTime);
 
-    // 2D
-    if (glfwGetKey(window, GLFW_KEY_J) == GLFW_PRESS) {
-        isIn3DMode = false;
-    }
-
-    // 3D
-    if (glfwGetKey(window, GLFW_KEY_M) == GLFW_PRESS) {
-        isIn3DMode = true;
+    // The material buffer is rewritten by the render phase
+    if (gIsActionHeld[ACTION_UV_SCALE_UP])
+    {
+        gTexturedMaterial.uvScale += 0.1f;
+        gMaterials.isDirty = true;
+        gRedraw.dirty |= REDRAW_MATERIALS;
+        ULOG_RATE_LIMITED(LOG_LEVEL_INFO, 4, "Current scale (%g, %g)", gTexturedMaterial.uvScale[0], gTexturedMaterial.uvScale[1]);
     }
-
-    if (glfwGetKey(window, GLFW_KEY_1) == GLFW_PRESS && gTexWrapMode != GL_REPEAT)
+    else if (gIsActionHeld[ACTION_UV_SCALE_DOWN])
     {
-        glBindTexture(GL_TEXTURE_2D, gTextureId);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        glBindTexture(GL_TEXTURE_2D, 0);
+        gTexturedMaterial.uvScale -= 0.1f;
+        gMaterials.isDirty = true;
+        gRedraw.dirty |= REDRAW_MATERIALS;
+        ULOG_RATE_LIMITED(LOG_LEVEL_INFO, 4, "Current scale (%g, %g)", gTexturedMaterial.uvScale[0], gTexturedMaterial.uvScale[1]);
+    }
+}
 
-        gTexWrapMode = GL_REPEAT;
 
-        cout << "Current Texture Wrapping Mode: REPEAT" << endl;
-    }
-    else if (glfwGetKey(window, GLFW_KEY_2) == GLFW_PRESS && gTexWrapMode != GL_MIRRORED_REPEAT)
+// Applies GL state changes requested by input; called at the start of the render phase
+void UApplyPendingRenderState()
+{
+    if (gPendingTexWrapMode != gTexturedMaterial.wrapMode)
     {
-        glBindTexture(GL_TEXTURE_2D, gTextureId);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_MIRRORED_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_MIRRORED_REPEAT);
-        glBindTexture(GL_TEXTURE_2D, 0);
+        // Switches the material to the sampler (and bindless handle) for the new mode
+        gTexturedMaterial.wrapMode = gPendingTexWrapMode;
+        UResolveMaterialTexture(gMaterials, gTexturedMaterial);
+        ULogWrapMode(gTexturedMaterial.wrapMode);
+    }
 
-        gTexWrapMode = GL_MIRRORED_REPEAT;
+    UUploadMaterials(gMaterials);
+}
 
-        cout << "Current Texture Wrapping Mode: MIRRORED REPEAT" << endl;
-    }
-    else if (glfwGetKey(window, GLFW_KEY_3) == GLFW_PRESS && gTexWrapMode != GL_CLAMP_TO_EDGE)
+
+void ULogWrapMode(GLint wrapMode)
+{
+    switch (wrapMode)
     {
-        glBindTexture(GL_TEXTURE_2D, gTextureId);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glBindTexture(GL_TEXTURE_2D, 0);
+    case GL_REPEAT:
+        ULOG_INFO("Current Texture Wrapping Mode: REPEAT");
+        break;
+    case GL_MIRRORED_REPEAT:
+        ULOG_INFO("Current Texture Wrapping Mode: MIRRORED REPEAT");
+        break;
+    case GL_CLAMP_TO_EDGE:
+        ULOG_INFO("Current Texture Wrapping Mode: CLAMP TO EDGE");
+        break;
+    case GL_CLAMP_TO_BORDER:
+        ULOG_INFO("Current Texture Wrapping Mode: CLAMP TO BORDER");
+        break;
+    }
+}
 
-        gTexWrapMode = GL_CLAMP_TO_EDGE;
 
-        cout << "Current Texture Wrapping Mode: CLAMP TO EDGE" << endl;
-    }
-    else if (glfwGetKey(window, GLFW_KEY_4) == GLFW_PRESS && gTexWrapMode != GL_CLAMP_TO_BORDER)
-    {
-        float color[] = { 1.0f, 0.0f, 1.0f, 1.0f };
-        glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, color);
+// Remembers the oldest input event that the next presented frame will reflect
+void UMarkInputLatency(double eventTime)
+{
+    if (gInputLatency.oldestPendingEvent < 0.0 || eventTime < gInputLatency.oldestPendingEvent)
+        gInputLatency.oldestPendingEvent = eventTime;
+}
 
-        glBindTexture(GL_TEXTURE_2D, gTextureId);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-        glBindTexture(GL_TEXTURE_2D, 0);
 
-        gTexWrapMode = GL_CLAMP_TO_BORDER;
+// Called right after a swap: the pending events are now on their way to the screen
+void UPresentInputLatency()
+{
+    if (gInputLatency.oldestPendingEvent < 0.0)
+        return;
 
-        cout << "Current Texture Wrapping Mode: CLAMP TO BORDER" << endl;
-    }
+    double now = glfwGetTime();
+    double latency = now - gInputLatency.oldestPendingEvent;
+    gInputLatency.oldestPendingEvent = -1.0;
 
-    if (glfwGetKey(window, GLFW_KEY_RIGHT_BRACKET) == GLFW_PRESS)
-    {
-        gUVScale += 0.1f;
-        cout << "Current scale (" << gUVScale[0] << ", " << gUVScale[1] << ")" << endl;
-    }
-    else if (glfwGetKey(window, GLFW_KEY_LEFT_BRACKET) == GLFW_PRESS)
+    // Average and worst case over the profiler report interval
+    if (now - gInputLatency.windowStart > gProfiler.reportInterval)
     {
-        gUVScale -= 0.1f;
-        cout << "Current scale (" << gUVScale[0] << ", " << gUVScale[1] << ")" << endl;
+        gInputLatency.windowStart = now;
+        gInputLatency.total = 0.0;
+        gInputLatency.worst = 0.0;
+        gInputLatency.samples = 0;
     }
+    gInputLatency.total += latency;
+    gInputLatency.worst = std::max(gInputLatency.worst, latency);
+    ++gInputLatency.samples;
+
+    UProfilerSet("input.latencyAvgMs", 1000.0 * gInputLatency.total / gInputLatency.samples);
+    UProfilerSet("input.latencyMaxMs", 1000.0 * gInputLatency.worst);
+}
 
-    // Pause and resume lamp orbiting
-    static bool isLKeyDown = false;
-    if (glfwGetKey(window, GLFW_KEY_L) == GLFW_PRESS && !gIsLampOrbiting)
-        gIsLampOrbiting = true;
-    else if (glfwGetKey(window, GLFW_KEY_K) == GLFW_PRESS && gIsLampOrbiting)
-        gIsLampOrbiting = false;
 
+// glfw: queue key presses and releases for UProcessInput
+void UKeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+    gInputEvents.push_back({ INPUT_EVENT_KEY, key, action, 0.0, 0.0, glfwGetTime() });
 }
 
 
@@ -454,12 +1719,31 @@ void UProcessInput(GLFWwindow* window)
 void UResizeWindow(GLFWwindow* window, int width, int height)
 {
     glViewport(0, 0, width, height);
+
+    // The scene target and Hi-Z pyramid follow on the next frame
+    gFramebufferWidth = width;
+    gFramebufferHeight = height;
+    gRedraw.dirty |= REDRAW_WINDOW;
+}
+
+
+// glfw: the window contents were damaged (uncovered, restored) and have to be drawn again
+void URefreshWindow(GLFWwindow* window)
+{
+    gRedraw.dirty |= REDRAW_WINDOW;
 }
 
 
 // glfw: whenever the mouse moves, this callback is called
 // -------------------------------------------------------
 void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos)
+{
+    gInputEvents.push_back({ INPUT_EVENT_CURSOR, 0, 0, xpos, ypos, glfwGetTime() });
+}
+
+
+// Turns a cursor position into camera movement
+void UHandleMouseMovement(double xpos, double ypos)
 {
     if (gFirstMouse)
     {
@@ -475,6 +1759,8 @@ void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos)
     gLastY = ypos;
 
     gCamera.ProcessMouseMovement(xoffset, yoffset);
+    if (xoffset != 0.0f || yoffset != 0.0f)
+        gRedraw.dirty |= REDRAW_CAMERA;
 }
 
 
@@ -482,49 +1768,57 @@ void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos)
 // ----------------------------------------------------------------------
 void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset)
 {
-    gCamera.ProcessMouseScroll(yoffset);
+    gInputEvents.push_back({ INPUT_EVENT_SCROLL, 0, 0, xoffset, yoffset, glfwGetTime() });
 }
 
 // glfw: handle mouse button events
 // --------------------------------
 void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
+{
+    gInputEvents.push_back({ INPUT_EVENT_MOUSE_BUTTON, button, action, 0.0, 0.0, glfwGetTime() });
+}
+
+
+// Reports mouse button events
+void UHandleMouseButton(int button, int action)
 {
     switch (button)
     {
     case GLFW_MOUSE_BUTTON_LEFT:
     {
         if (action == GLFW_PRESS)
-            cout << "Left mouse button pressed" << endl;
+            ULOG_DEBUG("Left mouse button pressed");
         else
-            cout << "Left mouse button released" << endl;
+            ULOG_DEBUG("Left mouse button released");
     }
     break;
 
     case GLFW_MOUSE_BUTTON_MIDDLE:
     {
         if (action == GLFW_PRESS)
-            cout << "Middle mouse button pressed" << endl;
+            ULOG_DEBUG("Middle mouse button pressed");
         else
-            cout << "Middle mouse button released" << endl;
+            ULOG_DEBUG("Middle mouse button released");
     }
     break;
 
     case GLFW_MOUSE_BUTTON_RIGHT:
     {
         if (action == GLFW_PRESS)
-            cout << "Right mouse button pressed" << endl;
+            ULOG_DEBUG("Right mouse button pressed");
         else
-            cout << "Right mouse button released" << endl;
+            ULOG_DEBUG("Right mouse button released");
     }
     break;
 
     default:
-        cout << "Unhandled mouse button event" << endl;
+        ULOG_DEBUG("Unhandled mouse button event");
         break;
     }
 }
 
-void URender()
+// Draws and presents a frame; returns false if the window is minimized and nothing was drawn
+bool URender()
 {
     const float angularVelocity = glm::radians(45.0f);
     if (gIsLampOrbiting)
@@ -537,436 +1831,3471 @@ void URender()
         gLightPosition.z = newPosition.z;
     }
 
+    UApplyPendingRenderState();
+
+    // Nothing to draw into while the window is minimized
+    if (gFramebufferWidth == 0 || gFramebufferHeight == 0)
+    {
+        glfwSwapBuffers(gWindow);
+        UPresentInputLatency();
+        return false;
+    }
+
+    // Keep the scene target and Hi-Z pyramid the size of the framebuffer
+    if (gSceneTarget.width != gFramebufferWidth || gSceneTarget.height != gFramebufferHeight)
+    {
+        UCreateRenderTarget(gSceneTarget, gFramebufferWidth, gFramebufferHeight);
+        UCreateOcclusionCuller(gCuller, gFramebufferWidth, gFramebufferHeight);
+    }
+
+    // The frame left on screen before going idle is drawn at full scale
+    UUpdateDynamicResolution(gDynamicResolution, gSceneTarget, (gRedraw.dirty & REDRAW_FULL_RESOLUTION) != 0);
+    UBeginGpuFrameTimer(gDynamicResolution);
+
+    UUpdateSceneObjects();
+    UUpdateShadowCache(gShadow);
+
+    glm::mat4 view = gCamera.GetViewMatrix();
+    glm::mat4 projection = UGetProjection();
+
+    glBindFramebuffer(GL_FRAMEBUFFER, gSceneTarget.fbo);
+    glViewport(0, 0, gSceneTarget.renderWidth, gSceneTarget.renderHeight);
+
     glEnable(GL_DEPTH_TEST);
 
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    // Render the first rectangle
-    glBindVertexArray(gMesh.vao);
-    glUseProgram(gCubeProgramId);
+    // Phase 1: draw what was visible last frame and build the Hi-Z pyramid from its depth
+    UDrawSceneObjects(gCuller.phase1Commands, gCuller.phase1Counts, view, projection);
+    UBuildHiZ();
 
-    glm::mat4 rotation1 = glm::rotate(glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
-    glm::mat4 model1 = glm::translate(gRectanglePosition) * rotation1 * glm::scale(gRectangleScale);
+    // Phase 2: test every object against the pyramid and draw the ones phase 1 missed
+    UCullSceneObjects(projection * view);
+    UDrawSceneObjects(gCuller.phase2Commands, gCuller.phase2Counts, view, projection);
 
-    glUniformMatrix4fv(glGetUniformLocation(gCubeProgramId, "model"), 1, GL_FALSE, glm::value_ptr(model1));
-    glUniformMatrix4fv(glGetUniformLocation(gCubeProgramId, "view"), 1, GL_FALSE, glm::value_ptr(gCamera.GetViewMatrix()));
-    glUniformMatrix4fv(glGetUniformLocation(gCubeProgramId, "projection"), 1, GL_FALSE, glm::value_ptr(glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f)));
-    glUniform3f(glGetUniformLocation(gCubeProgramId, "objectColor"), gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(glGetUniformLocation(gCubeProgramId, "lightColor"), gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(glGetUniformLocation(gCubeProgramId, "lightPos"), gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    glUniform3f(glGetUniformLocation(gCubeProgramId, "viewPosition"), gCamera.Position.x, gCamera.Position.y, gCamera.Position.z);
+    glBindVertexArray(0);
+    glUseProgram(0);
 
-    // Activate texture unit 0 and bind the texture to it
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureId);
+    UCollectCullingStats();
+
+    // Scale the rendered region up to the window
+    UUpscaleToWindow(gDynamicResolution, gSceneTarget);
+    UEndGpuFrameTimer(gDynamicResolution);
+
+    glfwSwapBuffers(gWindow);
+    UPresentInputLatency();
+    return true;
+}
+
+
+// Rebuilds the scene object list and uploads its culling data
+void UUpdateSceneObjects()
+{
+    UBuildSceneObjects();
+    UBuildDrawBatches();
+
+    // Upload the per-object data read by the cull pass and the surface shaders
+    UReserveOcclusionCuller(gCuller, gSceneObjects.size());
+    UReserveObjectIndices(gSceneGeometry, gSceneObjects.size());
+
+    std::vector<GpuObjectData> objectData(gSceneObjects.size());
+    for (size_t i = 0; i < gSceneObjects.size(); ++i)
+    {
+        const SceneObject& object = gSceneObjects[i];
+        objectData[i].model = object.model;
+        objectData[i].boundsMin = glm::vec4(object.mesh->boundsMin, 1.0f);
+        objectData[i].boundsMax = glm::vec4(object.mesh->boundsMax, 1.0f);
+        objectData[i].drawInfo[0] = object.mesh->nVertices;
+        objectData[i].drawInfo[1] = (GLuint)object.mesh->firstVertex;
+        objectData[i].drawInfo[2] = object.material->index;
+    }
+
+    // The cull pass packs each batch's visible commands from its first object's slot
+    for (const DrawBatch& batch : gDrawBatches)
+    {
+        for (GLsizei i = 0; i < batch.objectCount; ++i)
+            objectData[batch.firstObject + i].drawInfo[3] = batch.firstObject;
+    }
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gCuller.objectBuffer);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, objectData.size() * sizeof(GpuObjectData), objectData.data());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
 
-    // Set the texture uniform in the shader program
-    glUniform1i(glGetUniformLocation(gCubeProgramId, "texture1"), 0);
 
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.nVertices);
+// Orders gSceneObjects so objects sharing a shader variant (and, without bindless handles, a sampler)
+// are adjacent, and records each run as a draw batch. The order is the same every frame, so the
+// per-object visibility the cull pass keeps stays with its object.
+void UBuildDrawBatches()
+{
+    // Only textured draws without bindless handles depend on the bound sampler
+    auto batchSampler = [](const SceneObject& object)
+    {
+        bool isTextured = (UNormalizeShaderFeatures(object.material->features) & SHADER_FEATURE_TEXTURED) != 0;
+        return isTextured && !gMaterials.hasBindless ? object.material->samplerId : 0;
+    };
+
+    std::stable_sort(gSceneObjects.begin(), gSceneObjects.end(), [&](const SceneObject& first, const SceneObject& second)
+    {
+        return std::make_pair(UNormalizeShaderFeatures(first.material->features), batchSampler(first)) <
+            std::make_pair(UNormalizeShaderFeatures(second.material->features), batchSampler(second));
+    });
+
+    gDrawBatches.clear();
+    for (size_t i = 0; i < gSceneObjects.size(); ++i)
+    {
+        unsigned features = UNormalizeShaderFeatures(gSceneObjects[i].material->features);
+        GLuint samplerId = batchSampler(gSceneObjects[i]);
+
+        if (gDrawBatches.empty() || gDrawBatches.back().features != features || gDrawBatches.back().samplerId != samplerId)
+            gDrawBatches.push_back({ features, samplerId, (GLuint)i, 0 });
+        ++gDrawBatches.back().objectCount;
+    }
+}
+
+
+// Fills gSceneObjects with this frame's meshes, materials and transforms; CPU only
+void UBuildSceneObjects()
+{
+    const float angularVelocity = glm::radians(45.0f);
 
-    // Render the second rectangle
-    glBindVertexArray(gMesh.vao);
-    glUseProgram(gCubeProgramId);
+    gSceneObjects.clear();
+
+    // First rectangle
+    glm::mat4 rotation1 = glm::rotate(glm::radians(90.0f), glm::vec3(1.0f, 0.0f, 0.0f));
+    glm::mat4 model1 = glm::translate(gRectanglePosition) * rotation1 * glm::scale(gRectangleScale);
+    gSceneObjects.push_back({ &gMesh, &gTexturedMaterial, model1 });
 
+    // Second rectangle
+    glm::mat4 model2;
     if (isIn3DMode) {
         glm::mat4 rotation2 = glm::rotate(glm::radians(45.0f), glm::vec3(0.0f, 1.0f, 0.0f));
         glm::vec3 secondRectanglePosition(-0.15f, 1.0f, 0.0f);
         glm::vec3 secondRectangleScale(2.0f, 0.75f, 1.0f);
-        glm::mat4 model2 = glm::translate(secondRectanglePosition) * rotation2 * glm::scale(secondRectangleScale);
-        glUniformMatrix4fv(glGetUniformLocation(gCubeProgramId, "model"), 1, GL_FALSE, glm::value_ptr(model2));
+        model2 = glm::translate(secondRectanglePosition) * rotation2 * glm::scale(secondRectangleScale);
     }
     else {
         glm::mat4 rotation2 = glm::rotate(glm::radians(45.0f), glm::vec3(0.0f, 0.0f, 1.0f)); // Update the rotation axis
         glm::vec3 secondRectanglePosition(-0.15f, 1.0f, 0.0f); // Update the rectangle position
         glm::vec3 secondRectangleScale(2.0f, 0.75f, 0.0f); // Update the rectangle scale (set z-axis to 0)
-        glm::mat4 model2 = glm::translate(secondRectanglePosition) * rotation2 * glm::scale(secondRectangleScale);
-        glUniformMatrix4fv(glGetUniformLocation(gCubeProgramId, "model"), 1, GL_FALSE, glm::value_ptr(model2));
+        model2 = glm::translate(secondRectanglePosition) * rotation2 * glm::scale(secondRectangleScale);
     }
+    gSceneObjects.push_back({ &gMesh, &gTexturedMaterial, model2 });
+
+    // Cylinder
+    glm::vec3 cylinderPosition(1.5f, 0.85f, 0.0f); // Update the cylinder position
+    glm::vec3 cylinderScale = isIn3DMode ? glm::vec3(1.0f, 2.5f, 1.0f) : glm::vec3(1.0f, 2.5f, 0.0f); // Set z-axis to 0 in 2D
+    glm::mat4 cylinderRotation = glm::rotate(glm::radians(-90.0f), glm::vec3(1.0f, 0.0f, 0.0f)); // Make the cylinder stand vertically
+    glm::mat4 cylinderModel = glm::translate(cylinderPosition) * cylinderRotation * glm::scale(cylinderScale);
+    gSceneObjects.push_back({ &gCylinder, &gPlainMaterial, cylinderModel });
+
+    // Sphere
+    glm::vec3 spherePosition(-1.5f, 1.0f, 0.0f); // Update the sphere position
+    glm::vec3 sphereScale = isIn3DMode ? glm::vec3(1.5f) : glm::vec3(1.5f, 1.5f, 0.01f);
+    glm::mat4 sphereModel = glm::translate(spherePosition) * glm::scale(sphereScale);
+    gSceneObjects.push_back({ &gSphere, &gPlainMaterial, sphereModel });
+
+    // Second light source
+    float angle = angularVelocity * gDeltaTime; // Calculate the angle based on the elapsed time or any other desired value
+    glm::mat4 rotation2 = glm::rotate(angle, glm::vec3(0.0f, 1.0f, 0.0f)); // Update the rotation of the second light source
+    glm::mat4 secondLightModel = glm::translate(gSecondLightPosition) * rotation2 * glm::scale(gSecondLightScale);
+    gSceneObjects.push_back({ &gCylinder, &gLampMaterial, secondLightModel, false, false }); // Lamps don't cast shadows
+}
 
-    glUniformMatrix4fv(glGetUniformLocation(gCubeProgramId, "view"), 1, GL_FALSE, glm::value_ptr(gCamera.GetViewMatrix()));
-    glUniformMatrix4fv(glGetUniformLocation(gCubeProgramId, "projection"), 1, GL_FALSE, glm::value_ptr(glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f)));
-    glUniform3f(glGetUniformLocation(gCubeProgramId, "objectColor"), gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(glGetUniformLocation(gCubeProgramId, "lightColor"), gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(glGetUniformLocation(gCubeProgramId, "lightPos"), gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    glUniform3f(glGetUniformLocation(gCubeProgramId, "viewPosition"), gCamera.Position.x, gCamera.Position.y, gCamera.Position.z);
 
-    // Activate texture unit 0 and bind the texture to it
+// Draws every scene object through the given indirect command buffer, one multi-draw per draw batch.
+// With indirect counts each batch draws only the commands the cull pass packed at its start;
+// otherwise every object has a command and culled ones have an instance count of 0.
+void UDrawSceneObjects(GLuint commandBuffer, GLuint countBuffer, const glm::mat4& view, const glm::mat4& projection)
+{
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+    if (gCuller.hasIndirectCount)
+        glBindBuffer(GL_PARAMETER_BUFFER_ARB, countBuffer);
+    glBindVertexArray(gSceneGeometry.vao);
+
+    // Everything per object is in buffers bound once for the pass: each draw's baseInstance is its
+    // object index, which picks its transform and material index from the object buffer
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, gCuller.objectBuffer);
+    UBindMaterials(gMaterials);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_CUBE_MAP, gShadow.sampledCubeMap);
     glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureId);
 
-    // Set the texture uniform in the shader program
-    glUniform1i(glGetUniformLocation(gCubeProgramId, "texture1"), 0);
+    for (const DrawBatch& batch : gDrawBatches)
+    {
+        // Variants requested mid-frame aren't ready yet; the batch appears once its variant links
+        GLuint programId = UGetShaderVariant(gShaderManager, gSurfaceShader, batch.features);
+        if (programId == 0)
+            continue;
 
-    glDrawArrays(GL_TRIANGLES, 0, gMesh.nVertices);
+        glUseProgram(programId);
 
-    // Render the cylinder
-    glBindVertexArray(gCylinder.vao);
-    glUseProgram(gCubeProgramId);
+        // Only the uniforms the variant declares are set
+        glUniformMatrix4fv(glGetUniformLocation(programId, "view"), 1, GL_FALSE, glm::value_ptr(view));
+        glUniformMatrix4fv(glGetUniformLocation(programId, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
 
-    if (isIn3DMode) {
-        glm::vec3 cylinderPosition(1.5f, 0.85f, 0.0f); // Update the cylinder position
-        glm::vec3 cylinderScale(1.0f, 2.5f, 1.0f); // Update the cylinder scale
-        glm::mat4 cylinderRotation = glm::rotate(glm::radians(-90.0f), glm::vec3(1.0f, 0.0f, 0.0f)); // Make the cylinder stand vertically
-        glm::mat4 cylinderModel = glm::translate(cylinderPosition) * cylinderRotation * glm::scale(cylinderScale);
-        glUniformMatrix4fv(glGetUniformLocation(gCubeProgramId, "model"), 1, GL_FALSE, glm::value_ptr(cylinderModel));
-    }
-    else {
-        glm::vec3 cylinderPosition(1.5f, 0.85f, 0.0f); // Update the cylinder position
-        glm::vec3 cylinderScale(1.0f, 2.5f, 0.0f); // Update the cylinder scale (set z-axis to 0)
-        glm::mat4 cylinderRotation = glm::rotate(glm::radians(-90.0f), glm::vec3(1.0f, 0.0f, 0.0f)); // Make the cylinder stand vertically
-        glm::mat4 cylinderModel = glm::translate(cylinderPosition) * cylinderRotation * glm::scale(cylinderScale);
-        glUniformMatrix4fv(glGetUniformLocation(gCubeProgramId, "model"), 1, GL_FALSE, glm::value_ptr(cylinderModel));
+        // Without bindless handles the wrap mode comes from the sampler on the arrays' units
+        if (batch.samplerId != 0)
+        {
+            for (int i = 0; i < MAX_TEXTURE_ARRAYS; ++i)
+                glBindSampler(MATERIAL_TEXTURE_UNIT + i, batch.samplerId);
+        }
+
+        if (batch.features & SHADER_FEATURE_LIT)
+        {
+            glUniform3f(glGetUniformLocation(programId, "lightColor"), gLightColor.r, gLightColor.g, gLightColor.b);
+            glUniform3f(glGetUniformLocation(programId, "lightPos"), gLightPosition.x, gLightPosition.y, gLightPosition.z);
+            glUniform3f(glGetUniformLocation(programId, "viewPosition"), gCamera.Position.x, gCamera.Position.y, gCamera.Position.z);
+
+            glUniform1f(glGetUniformLocation(programId, "shadowFarPlane"), SHADOW_FAR_PLANE);
+            glUniform1i(glGetUniformLocation(programId, "pcfSamples"), gShadowPcfSamples);
+        }
+
+        const GLvoid* commands = (const GLvoid*)(batch.firstObject * sizeof(DrawArraysIndirectCommand));
+        if (gCuller.hasIndirectCount)
+            glMultiDrawArraysIndirectCountARB(GL_TRIANGLES, commands, batch.firstObject * sizeof(GLuint), batch.objectCount, 0);
+        else
+            glMultiDrawArraysIndirect(GL_TRIANGLES, commands, batch.objectCount, 0);
     }
 
-    glDrawArrays(GL_TRIANGLES, 0, gCylinder.nVertices);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    if (gCuller.hasIndirectCount)
+        glBindBuffer(GL_PARAMETER_BUFFER_ARB, 0);
+}
 
-    // Render the sphere
-    glBindVertexArray(gSphere.vao);
-    glUseProgram(gCubeProgramId);
 
-    glm::vec3 spherePosition(-1.5f, 1.0f, 0.0f); // Update the sphere position
-    glm::mat4 sphereModel;
+// Builds the Hi-Z pyramid over the rendered region: level 0 is a copy of the scene depth, each further
+// level keeps the max of 2x2 texels
+void UBuildHiZ()
+{
+    int width = gSceneTarget.renderWidth;
+    int height = gSceneTarget.renderHeight;
 
-    if (isIn3DMode) {
-        glm::vec3 sphereScale(1.5f);
-        sphereModel = glm::translate(spherePosition) * glm::scale(sphereScale);
+    gCuller.activeWidth = width;
+    gCuller.activeHeight = height;
+    gCuller.activeLevels = 1;
+    for (int size = std::max(width, height); size > 1; size /= 2)
+        ++gCuller.activeLevels;
+
+    glUseProgram(gHiZCopyProgramId);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, gSceneTarget.depthTexture);
+    glUniform1i(glGetUniformLocation(gHiZCopyProgramId, "depthTexture"), 0);
+    glUniform2i(glGetUniformLocation(gHiZCopyProgramId, "size"), width, height);
+    glBindImageTexture(0, gCuller.hiZTexture, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+    glDispatchCompute((width + 7) / 8, (height + 7) / 8, 1);
+
+    glUseProgram(gHiZReduceProgramId);
+    glBindTexture(GL_TEXTURE_2D, gCuller.hiZTexture);
+    glUniform1i(glGetUniformLocation(gHiZReduceProgramId, "hiZ"), 0);
+
+    for (int level = 1; level < gCuller.activeLevels; ++level)
+    {
+        int destinationWidth = std::max(1, width / 2);
+        int destinationHeight = std::max(1, height / 2);
+
+        // Wait for the previous level to be written before reading it
+        glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+
+        glUniform1i(glGetUniformLocation(gHiZReduceProgramId, "sourceLevel"), level - 1);
+        glUniform2i(glGetUniformLocation(gHiZReduceProgramId, "sourceSize"), width, height);
+        glUniform2i(glGetUniformLocation(gHiZReduceProgramId, "destinationSize"), destinationWidth, destinationHeight);
+        glBindImageTexture(0, gCuller.hiZTexture, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+        glDispatchCompute((destinationWidth + 7) / 8, (destinationHeight + 7) / 8, 1);
+
+        width = destinationWidth;
+        height = destinationHeight;
     }
-    else {
-        glm::vec3 sphereScale(1.5f, 1.5f, 0.01f);
-        sphereModel = glm::translate(spherePosition) * glm::scale(sphereScale);
+
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+
+// Tests every scene object against the frustum and the Hi-Z pyramid and writes both command buffers
+void UCullSceneObjects(const glm::mat4& viewProjection)
+{
+    // Reset the visible/culled counters, and the draw counts now that phase 1 has drawn last frame's
+    const GLuint zero = 0;
+    for (GLuint buffer : { (GLuint)gCuller.statsBuffer, (GLuint)gCuller.phase1Counts, (GLuint)gCuller.phase2Counts })
+    {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
     }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 
-    glUniformMatrix4fv(glGetUniformLocation(gCubeProgramId, "model"), 1, GL_FALSE, glm::value_ptr(sphereModel));
-    glUniformMatrix4fv(glGetUniformLocation(gCubeProgramId, "view"), 1, GL_FALSE, glm::value_ptr(gCamera.GetViewMatrix()));
-    glUniformMatrix4fv(glGetUniformLocation(gCubeProgramId, "projection"), 1, GL_FALSE, glm::value_ptr(glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f)));
-    glUniform3f(glGetUniformLocation(gCubeProgramId, "objectColor"), gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(glGetUniformLocation(gCubeProgramId, "lightColor"), gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(glGetUniformLocation(gCubeProgramId, "lightPos"), gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    glUniform3f(glGetUniformLocation(gCubeProgramId, "viewPosition"), gCamera.Position.x, gCamera.Position.y, gCamera.Position.z);
+    glUseProgram(gCullProgramId);
+    glUniformMatrix4fv(glGetUniformLocation(gCullProgramId, "viewProjection"), 1, GL_FALSE, glm::value_ptr(viewProjection));
+    glUniform1ui(glGetUniformLocation(gCullProgramId, "objectCount"), (GLuint)gSceneObjects.size());
+    glUniform2i(glGetUniformLocation(gCullProgramId, "hiZSize"), gCuller.activeWidth, gCuller.activeHeight);
+    glUniform1i(glGetUniformLocation(gCullProgramId, "hiZLevels"), gCuller.activeLevels);
+    glUniform1i(glGetUniformLocation(gCullProgramId, "compactCommands"), gCuller.hasIndirectCount);
 
-    // Activate texture unit 0 and bind the texture to it
     glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, gTextureId);
+    glBindTexture(GL_TEXTURE_2D, gCuller.hiZTexture);
+    glUniform1i(glGetUniformLocation(gCullProgramId, "hiZ"), 0);
 
-    // Set the texture uniform in the shader program
-    glUniform1i(glGetUniformLocation(gCubeProgramId, "texture1"), 0);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, gCuller.objectBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, gCuller.visibilityBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, gCuller.phase1Commands);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, gCuller.phase2Commands);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, gCuller.statsBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, gCuller.phase1Counts);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, gCuller.phase2Counts);
 
-    glDrawArrays(GL_TRIANGLES, 0, gSphere.nVertices);
+    glDispatchCompute(((GLuint)gSceneObjects.size() + 63) / 64, 1, 1);
 
-    // Render the second light source
-    glBindVertexArray(gCylinder.vao);
-    glUseProgram(gLampProgramId);
+    // Make the commands visible to the indirect draws and the counters to the stats copy
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
 
-    float angle = angularVelocity * gDeltaTime; // Calculate the angle based on the elapsed time or any other desired value
-    glm::mat4 rotation2 = glm::rotate(angle, glm::vec3(0.0f, 1.0f, 0.0f)); // Update the rotation of the second light source
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
 
-    glm::vec3 secondLightPosition(0.0f, 1.5f, 1.0f); // Update the position of the second light source
-    glm::vec3 secondLightColor(0.0f, 1.0f, 0.0f); // Update the color of the second light source
-    glm::vec3 secondLightScale(0.05f); // Update the scale of the second light source
 
-    glm::mat4 secondLightModel = glm::translate(secondLightPosition) * rotation2 * glm::scale(secondLightScale);
+// Hands the culling counters to the profiler. They are copied into a ring of buffers and only read
+// once their fence has signalled, a few frames later, so the CPU never waits on the GPU.
+void UCollectCullingStats()
+{
+    const int ringSize = sizeof(gCuller.statsReadback) / sizeof(gCuller.statsReadback[0]);
+    int slot = gCuller.statsFrame % ringSize;
 
-    glUniformMatrix4fv(glGetUniformLocation(gLampProgramId, "model"), 1, GL_FALSE, glm::value_ptr(secondLightModel));
-    glUniformMatrix4fv(glGetUniformLocation(gLampProgramId, "view"), 1, GL_FALSE, glm::value_ptr(gCamera.GetViewMatrix()));
-    glUniformMatrix4fv(glGetUniformLocation(gLampProgramId, "projection"), 1, GL_FALSE, glm::value_ptr(glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f)));
-    glUniform3f(glGetUniformLocation(gLampProgramId, "lightColor"), secondLightColor.r, secondLightColor.g, secondLightColor.b);
-    glUniform3f(glGetUniformLocation(gLampProgramId, "lightPos"), secondLightPosition.x, secondLightPosition.y, secondLightPosition.z);
+    if (gCuller.statsFences[slot])
+    {
+        GLenum status = glClientWaitSync(gCuller.statsFences[slot], 0, 0);
+        if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED)
+        {
+            GLuint stats[3];
+            glBindBuffer(GL_COPY_READ_BUFFER, gCuller.statsReadback[slot]);
+            glGetBufferSubData(GL_COPY_READ_BUFFER, 0, sizeof(stats), stats);
 
-    glDrawArrays(GL_TRIANGLES, 0, gCylinder.nVertices);
+            UProfilerSet("occlusion.visible", stats[0]);
+            UProfilerSet("occlusion.frustumCulled", stats[1]);
+            UProfilerSet("occlusion.occlusionCulled", stats[2]);
+        }
+        glDeleteSync(gCuller.statsFences[slot]);
+        gCuller.statsFences[slot] = 0;
+    }
 
-    glBindVertexArray(0);
-    glUseProgram(0);
+    glBindBuffer(GL_COPY_READ_BUFFER, gCuller.statsBuffer);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, gCuller.statsReadback[slot]);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, 3 * sizeof(GLuint));
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
 
-    glfwSwapBuffers(gWindow);
+    gCuller.statsFences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    ++gCuller.statsFrame;
 }
 
-void UCreateMesh(GLMesh& mesh, GLMesh& cylinder, GLMesh& sphere)
+
+// Allocates the static and composited shadow cube maps
+void UCreateShadowCache(ShadowCache& shadow)
 {
-    GLfloat verts[] = {
-        // First Rectangle
-      // Front face
-      -0.5f,  0.5f,  0.5f, 1.0f, 0.0f, 0.0f, 1.0f,   // Top left
-      0.5f,  0.5f,  0.5f, 1.0f, 0.0f, 0.0f, 1.0f,   // Top right
-      0.5f, -0.5f,  0.5f, 1.0f, 0.0f, 0.0f, 1.0f,   // Bottom right
-      0.5f, -0.5f,  0.5f, 1.0f, 0.0f, 0.0f, 1.0f,   // Bottom right
-      -0.5f, -0.5f,  0.5f, 1.0f, 0.0f, 0.0f, 1.0f,   // Bottom left
-      -0.5f,  0.5f,  0.5f, 1.0f, 0.0f, 0.0f, 1.0f,   // Top left
+    GpuHandle* cubeMaps[] = { &shadow.staticCubeMap, &shadow.cubeMap };
+    GpuHandle* fbos[] = { &shadow.staticFbo, &shadow.fbo };
 
-      // Right face
-      0.5f,  0.5f,  0.5f, 0.0f, 1.0f, 0.0f, 1.0f,   // Top left
+    for (int i = 0; i < 2; ++i)
+    {
+        *cubeMaps[i] = UCreateGpuTexture(gGpuResources, { GL_TEXTURE_CUBE_MAP, 1, GL_DEPTH_COMPONENT32F, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE }, "shadow cube map");
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+
+        // Layered attachment: the geometry shader picks the face with gl_Layer
+        *fbos[i] = UCreateGpuObject(gGpuResources, GPU_RESOURCE_FRAMEBUFFER, "shadow");
+        glBindFramebuffer(GL_FRAMEBUFFER, *fbos[i]);
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, *cubeMaps[i], 0);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            ULOG_ERROR("ERROR::FRAMEBUFFER::SHADOW_INCOMPLETE");
+    }
+
+    glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    shadow.isValid = false;
+    shadow.sampledCubeMap = shadow.staticCubeMap;
+}
+
+
+void UDestroyShadowCache(ShadowCache& shadow)
+{
+    shadow.staticFbo.reset();
+    shadow.fbo.reset();
+    shadow.staticCubeMap.reset();
+    shadow.cubeMap.reset();
+    shadow = ShadowCache();
+}
+
+
+// Brings the shadow maps up to date. The static map is only redrawn when the light or a static
+// caster has moved since it was last drawn; dynamic casters go on top of a copy of it, and that
+// composite is only redone when the static map or a dynamic caster has changed.
+void UUpdateShadowCache(ShadowCache& shadow)
+{
+    std::vector<glm::mat4> staticCasters;
+    std::vector<glm::mat4> dynamicCasters;
+    for (const SceneObject& object : gSceneObjects)
+    {
+        if (!object.castsShadow)
+            continue;
+
+        if (object.isStatic)
+            staticCasters.push_back(object.model);
+        else
+            dynamicCasters.push_back(object.model);
+    }
+
+    glEnable(GL_DEPTH_TEST);
+    glViewport(0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
+
+    bool isStaticRedrawn = false;
+    if (!shadow.isValid || shadow.lightPosition != gLightPosition || shadow.staticCasters != staticCasters)
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, shadow.staticFbo);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        UDrawShadowCasters(shadow.staticFbo, true);
+
+        shadow.isValid = true;
+        shadow.lightPosition = gLightPosition;
+        shadow.staticCasters.swap(staticCasters);
+        ++shadow.staticRedraws;
+        isStaticRedrawn = true;
+    }
+
+    if (dynamicCasters.empty())
+    {
+        shadow.dynamicCasters.clear(); // Casters that come back later are composited again
+        shadow.sampledCubeMap = shadow.staticCubeMap;
+    }
+    else
+    {
+        if (isStaticRedrawn || shadow.dynamicCasters != dynamicCasters)
+        {
+            glCopyImageSubData(shadow.staticCubeMap, GL_TEXTURE_CUBE_MAP, 0, 0, 0, 0,
+                               shadow.cubeMap, GL_TEXTURE_CUBE_MAP, 0, 0, 0, 0,
+                               SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, 6);
+            UDrawShadowCasters(shadow.fbo, false);
+
+            shadow.dynamicCasters.swap(dynamicCasters);
+            ++shadow.compositeRedraws;
+        }
+        shadow.sampledCubeMap = shadow.cubeMap;
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    UProfilerSet("shadow.staticRedraws", shadow.staticRedraws);
+    UProfilerSet("shadow.compositeRedraws", shadow.compositeRedraws);
+}
+
+
+// Draws the static or the dynamic shadow casters into all six faces of a cube map
+void UDrawShadowCasters(GLuint fbo, bool isStatic)
+{
+    // Face order and up vectors follow the GL cube map convention
+    const glm::vec3 directions[6] = {
+        glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(-1.0f, 0.0f, 0.0f),
+        glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f),
+        glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, 0.0f, -1.0f)
+    };
+    const glm::vec3 ups[6] = {
+        glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f),
+        glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, 0.0f, -1.0f),
+        glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f)
+    };
+
+    glm::mat4 projection = glm::perspective(glm::radians(90.0f), 1.0f, 0.1f, SHADOW_FAR_PLANE);
+    glm::mat4 shadowMatrices[6];
+    for (int face = 0; face < 6; ++face)
+        shadowMatrices[face] = projection * glm::lookAt(gLightPosition, gLightPosition + directions[face], ups[face]);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glUseProgram(gShadowProgramId);
+    glUniformMatrix4fv(glGetUniformLocation(gShadowProgramId, "shadowMatrices"), 6, GL_FALSE, glm::value_ptr(shadowMatrices[0]));
+    glUniform3f(glGetUniformLocation(gShadowProgramId, "lightPos"), gLightPosition.x, gLightPosition.y, gLightPosition.z);
+    glUniform1f(glGetUniformLocation(gShadowProgramId, "farPlane"), SHADOW_FAR_PLANE);
+
+    glBindVertexArray(gSceneGeometry.vao);
+    for (const SceneObject& object : gSceneObjects)
+    {
+        if (!object.castsShadow || object.isStatic != isStatic)
+            continue;
+
+        glUniformMatrix4fv(glGetUniformLocation(gShadowProgramId, "model"), 1, GL_FALSE, glm::value_ptr(object.model));
+        glDrawArrays(GL_TRIANGLES, object.mesh->firstVertex, object.mesh->nVertices);
+    }
+
+    glBindVertexArray(0);
+    glUseProgram(0);
+}
+
+
+// Selects how buffer swaps are synchronized with the display
+void USetPresentMode(FramePacer& pacer, PresentMode mode)
+{
+    // Adaptive vsync needs the swap-tear extension; fall back to regular vsync without it
+    if (mode == PRESENT_ADAPTIVE_VSYNC &&
+        !glfwExtensionSupported("WGL_EXT_swap_control_tear") && !glfwExtensionSupported("GLX_EXT_swap_control_tear"))
+    {
+        ULOG_WARNING("Adaptive vsync is not supported, using vsync");
+        mode = PRESENT_VSYNC;
+    }
+
+    switch (mode)
+    {
+    case PRESENT_VSYNC:
+        glfwSwapInterval(1);
+        ULOG_INFO("Present mode: VSYNC");
+        break;
+    case PRESENT_ADAPTIVE_VSYNC:
+        glfwSwapInterval(-1); // Sync when on time, tear instead of waiting a whole refresh when late
+        ULOG_INFO("Present mode: ADAPTIVE VSYNC");
+        break;
+    case PRESENT_UNCAPPED:
+        glfwSwapInterval(0);
+        ULOG_INFO("Present mode: UNCAPPED");
+        break;
+    }
+
+    pacer.presentMode = mode;
+}
+
+
+// Sets the frame limiter target; 0 disables the limiter
+void USetFrameRateLimit(FramePacer& pacer, double framesPerSecond)
+{
+    pacer.targetFrameTime = framesPerSecond > 0.0 ? 1.0 / framesPerSecond : 0.0;
+
+    if (framesPerSecond > 0.0)
+        ULOG_INFO("Frame rate limit: %g", framesPerSecond);
+    else
+        ULOG_INFO("Frame rate limit: off");
+}
+
+
+// Sleeps until shortly before the given time, then spins for the rest so the wake-up is precise
+void UWaitUntil(double time)
+{
+    // OS sleeps can overshoot by a millisecond or more; the last stretch is spent yielding instead
+    const double spinMargin = 0.002;
+
+    for (;;)
+    {
+        double remaining = time - glfwGetTime();
+        if (remaining <= 0.0)
+            return;
+
+        if (remaining > spinMargin)
+            std::this_thread::sleep_for(std::chrono::duration<double>(remaining - spinMargin));
+        else
+            std::this_thread::yield();
+    }
+}
+
+
+// Starts a frame: waits out the frame limiter, measures the frame time in double precision,
+// updates the smoothed delta time and the pacing statistics. Returns the frame start time.
+double UBeginFrame(FramePacer& pacer)
+{
+    if (pacer.targetFrameTime > 0.0)
+        UWaitUntil(pacer.frameStart + pacer.targetFrameTime);
+
+    double now = glfwGetTime();
+    double frameTime = now - pacer.frameStart;
+    pacer.frameStart = now;
+
+    // Clamp spikes (window drags, breakpoints) so one long frame doesn't jump the scene
+    double delta = std::min(std::max(frameTime, 0.0), 0.25);
+    pacer.smoothedDelta += pacer.smoothing * (delta - pacer.smoothedDelta);
+    gDeltaTime = (float)pacer.smoothedDelta;
+
+    // A frame misses its deadline when it takes more than half a period longer than intended
+    double deadline = pacer.targetFrameTime > 0.0 ? pacer.targetFrameTime :
+                      pacer.presentMode != PRESENT_UNCAPPED ? pacer.refreshPeriod : 0.0;
+    if (deadline > 0.0 && frameTime > 1.5 * deadline)
+        ++pacer.missedDeadlines;
+
+    ++pacer.frames;
+    pacer.frameTimeSum += frameTime;
+    pacer.frameTimeSquaredSum += frameTime * frameTime;
+
+    if (now - pacer.windowStart >= gProfiler.reportInterval)
+    {
+        double mean = pacer.frameTimeSum / pacer.frames;
+        double variance = std::max(pacer.frameTimeSquaredSum / pacer.frames - mean * mean, 0.0);
+
+        UProfilerSet("frame.fps", pacer.frames / (now - pacer.windowStart));
+        UProfilerSet("frame.avgMs", 1000.0 * mean);
+        UProfilerSet("frame.stdDevMs", 1000.0 * sqrt(variance));
+        UProfilerSet("frame.missedDeadlines", pacer.missedDeadlines);
+
+        pacer.windowStart = now;
+        pacer.frames = 0;
+        pacer.missedDeadlines = 0;
+        pacer.frameTimeSum = 0.0;
+        pacer.frameTimeSquaredSum = 0.0;
+    }
+
+    return now;
+}
+
+
+// True while something on screen moves without further input: the orbiting lamp or a held key
+bool UIsAnimating()
+{
+    return gIsLampOrbiting || gHeldActionCount > 0;
+}
+
+
+// Whether the main loop has to draw a frame now
+bool UNeedsRedraw(const RedrawTracker& tracker)
+{
+    return !tracker.isOnDemand || tracker.dirty != 0 || UIsAnimating();
+}
+
+
+// Blocks until an input or window event arrives, or REDRAW_IDLE_TIMEOUT passes
+void UWaitForChanges(RedrawTracker& tracker, FramePacer& pacer)
+{
+    double start = glfwGetTime();
+    glfwWaitEventsTimeout(REDRAW_IDLE_TIMEOUT);
+    double waited = glfwGetTime() - start;
+
+    tracker.idleTime += waited;
+    ++tracker.idleWakeups;
+
+    // Idle time is not frame time: the first frame back is timed from where the last one ended
+    pacer.frameStart += waited;
+}
+
+
+// Publishes the active/idle split once per profiler interval
+void UReportRedrawStats(RedrawTracker& tracker, double currentTime)
+{
+    double elapsed = currentTime - tracker.windowStart;
+    if (elapsed < gProfiler.reportInterval)
+        return;
+
+    UProfilerSet("redraw.onDemand", tracker.isOnDemand ? 1.0 : 0.0);
+    UProfilerSet("redraw.activeFrames", tracker.activeFrames);
+    UProfilerSet("redraw.idleWakeups", tracker.idleWakeups);
+    UProfilerSet("redraw.idlePercent", 100.0 * tracker.idleTime / elapsed);
+
+    tracker.windowStart = currentTime;
+    tracker.activeFrames = 0;
+    tracker.idleWakeups = 0;
+    tracker.idleTime = 0.0;
+}
+
+
+// Creates the GPU timer queries and the upscale pass resources
+void UCreateDynamicResolution(DynamicResolution& resolution)
+{
+    glGenQueries(DYNAMIC_RESOLUTION_QUERY_COUNT, resolution.timerQueries);
+
+    // The upscale pass draws a single triangle generated from gl_VertexID
+    resolution.fullscreenVao = UCreateGpuObject(gGpuResources, GPU_RESOURCE_VERTEX_ARRAY, "fullscreen triangle");
+}
+
+
+void UDestroyDynamicResolution(DynamicResolution& resolution)
+{
+    glDeleteQueries(DYNAMIC_RESOLUTION_QUERY_COUNT, resolution.timerQueries);
+    resolution.fullscreenVao.reset();
+    resolution = DynamicResolution();
+}
+
+
+// Reads back the GPU time of an earlier frame, if it is ready, and steers the resolution scale so the
+// GPU time settles at the frame budget. forceFullResolution renders this frame at maxScale.
+// Never waits on the GPU.
+void UUpdateDynamicResolution(DynamicResolution& resolution, RenderTarget& target, bool forceFullResolution)
+{
+    int slot = resolution.queryFrame % DYNAMIC_RESOLUTION_QUERY_COUNT;
+    bool hasNewTiming = false;
+
+    if (resolution.isQueryPending[slot])
+    {
+        GLint isAvailable = 0;
+        glGetQueryObjectiv(resolution.timerQueries[slot], GL_QUERY_RESULT_AVAILABLE, &isAvailable);
+        if (isAvailable)
+        {
+            GLuint64 elapsed = 0;
+            glGetQueryObjectui64v(resolution.timerQueries[slot], GL_QUERY_RESULT, &elapsed);
+            resolution.gpuFrameTime = elapsed * 1.0e-9;
+            hasNewTiming = true;
+        }
+        // A result that is still not ready is dropped; the query is reissued this frame
+        resolution.isQueryPending[slot] = false;
+    }
+
+    if (!resolution.isEnabled || forceFullResolution)
+    {
+        resolution.scale = resolution.maxScale;
+    }
+    else if (hasNewTiming)
+    {
+        double frameBudget = gFramePacer.targetFrameTime > 0.0 ? gFramePacer.targetFrameTime : gFramePacer.refreshPeriod;
+        double budget = frameBudget * resolution.headroom;
+
+        // Fill cost follows the pixel count, so the scale that meets the budget goes with the square root of the ratio
+        double desiredScale = resolution.scale * sqrt(budget / std::max(resolution.gpuFrameTime, 1.0e-5));
+        resolution.scale += (float)(resolution.gain * (desiredScale - resolution.scale));
+        resolution.scale = std::min(std::max(resolution.scale, resolution.minScale), resolution.maxScale);
+    }
+
+    target.renderWidth = std::max(1, (int)(target.width * resolution.scale + 0.5f));
+    target.renderHeight = std::max(1, (int)(target.height * resolution.scale + 0.5f));
+
+    UProfilerSet("resolution.scale", resolution.scale);
+    UProfilerSet("resolution.gpuMs", 1000.0 * resolution.gpuFrameTime);
+}
+
+
+// Times the GPU work of the frame; pair with UEndGpuFrameTimer
+void UBeginGpuFrameTimer(DynamicResolution& resolution)
+{
+    int slot = resolution.queryFrame % DYNAMIC_RESOLUTION_QUERY_COUNT;
+    glBeginQuery(GL_TIME_ELAPSED, resolution.timerQueries[slot]);
+}
+
+
+void UEndGpuFrameTimer(DynamicResolution& resolution)
+{
+    int slot = resolution.queryFrame % DYNAMIC_RESOLUTION_QUERY_COUNT;
+    glEndQuery(GL_TIME_ELAPSED);
+    resolution.isQueryPending[slot] = true;
+    ++resolution.queryFrame;
+}
+
+
+// Scales the rendered region of the target up to the whole window
+void UUpscaleToWindow(const DynamicResolution& resolution, const RenderTarget& target)
+{
+    if (resolution.filter == UPSCALE_BILINEAR)
+    {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, target.fbo);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+        glBlitFramebuffer(0, 0, target.renderWidth, target.renderHeight, 0, 0, gFramebufferWidth, gFramebufferHeight, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        return;
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(0, 0, gFramebufferWidth, gFramebufferHeight);
+    glDisable(GL_DEPTH_TEST);
+
+    glUseProgram(gUpscaleProgramId);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, target.colorTexture);
+    glUniform1i(glGetUniformLocation(gUpscaleProgramId, "sceneColor"), 0);
+    glUniform2f(glGetUniformLocation(gUpscaleProgramId, "uvScale"), (float)target.renderWidth / target.width, (float)target.renderHeight / target.height);
+    glUniform1f(glGetUniformLocation(gUpscaleProgramId, "sharpness"), resolution.sharpness);
+
+    glBindVertexArray(resolution.fullscreenVao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+
+    glBindVertexArray(0);
+    glUseProgram(0);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glEnable(GL_DEPTH_TEST);
+}
+
+
+// Records the latest value of a named statistic
+void UProfilerSet(const char* name, double value)
+{
+    gProfiler.values[name] = value;
+}
+
+
+// Prints every statistic once per report interval
+void UProfilerReport(double currentTime)
+{
+    if (gProfiler.values.empty() || currentTime - gProfiler.lastReport < gProfiler.reportInterval)
+        return;
+
+    gProfiler.lastReport = currentTime;
+
+    UProfilerSet("log.dropped", gLogger.dropped);
+    UProfilerSet("log.rateLimited", gLogger.rateLimited);
+
+    // Split the report into as many records as it takes to fit the log record size
+    std::string line = "PROFILER:";
+    for (const auto& entry : gProfiler.values)
+    {
+        char item[128];
+        snprintf(item, sizeof(item), " %s=%g", entry.first.c_str(), entry.second);
+
+        if (line.size() + strlen(item) >= LOG_RECORD_TEXT_SIZE)
+        {
+            ULOG_INFO("%s", line.c_str());
+            line = "PROFILER:";
+        }
+        line += item;
+    }
+    ULOG_INFO("%s", line.c_str());
+}
+
+
+// Starts the background log writer
+void ULogStart()
+{
+    for (size_t i = 0; i < LOG_RING_CAPACITY; ++i)
+        gLogger.cells[i].sequence.store(i, std::memory_order_relaxed);
+
+    gLogger.enqueuePosition.store(0, std::memory_order_relaxed);
+    gLogger.dequeuePosition = 0;
+    gLogger.startTime = std::chrono::steady_clock::now();
+    gLogger.isRunning = true;
+    gLogger.worker = std::thread(ULogWorker);
+}
+
+
+// Writes out every queued record and stops the background log writer
+void ULogStop()
+{
+    gLogger.isRunning = false;
+    if (gLogger.worker.joinable())
+        gLogger.worker.join();
+
+    if (gLogger.dropped || gLogger.rateLimited)
+        fprintf(stdout, "Log: %u records dropped, %u rate limited\n", gLogger.dropped.load(), gLogger.rateLimited.load());
+}
+
+
+// Formats a record into the log ring. Never blocks: if the ring is full the record is dropped and counted.
+void ULog(int level, const char* format, ...)
+{
+    if (level < gLogger.minLevel.load(std::memory_order_relaxed))
+        return;
+
+    // Claim a cell; a cell is free for this lap when its sequence equals the enqueue position
+    LogCell* cell;
+    size_t position = gLogger.enqueuePosition.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        cell = &gLogger.cells[position & (LOG_RING_CAPACITY - 1)];
+        size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+
+        if (difference == 0)
+        {
+            if (gLogger.enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                break;
+        }
+        else if (difference < 0)
+        {
+            gLogger.dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        else
+        {
+            position = gLogger.enqueuePosition.load(std::memory_order_relaxed);
+        }
+    }
+
+    cell->level = level;
+    cell->time = std::chrono::duration<double>(std::chrono::steady_clock::now() - gLogger.startTime).count();
+
+    va_list arguments;
+    va_start(arguments, format);
+    vsnprintf(cell->text, sizeof(cell->text), format, arguments);
+    va_end(arguments);
+
+    // Publish the cell to the worker
+    cell->sequence.store(position + 1, std::memory_order_release);
+}
+
+
+// Returns true if the call site may log now; otherwise counts the record as rate limited
+bool ULogAllow(LogRateLimiter& limiter)
+{
+    long long second = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+
+    long long windowStart = limiter.windowStart.load(std::memory_order_relaxed);
+    if (windowStart != second && limiter.windowStart.compare_exchange_strong(windowStart, second, std::memory_order_relaxed))
+        limiter.count.store(0, std::memory_order_relaxed);
+
+    if (limiter.count.fetch_add(1, std::memory_order_relaxed) < limiter.maxPerSecond)
+        return true;
+
+    gLogger.rateLimited.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+
+// Background thread: drains the ring, prefixes each record with its time and level, and writes the batch in one call
+void ULogWorker()
+{
+    static const char* const levelNames[] = { "DEBUG", "INFO", "WARNING", "ERROR" };
+
+    std::string batch;
+    for (;;)
+    {
+        // Read the flag before draining so records pushed before a stop are always written
+        bool isRunning = gLogger.isRunning.load();
+
+        batch.clear();
+        for (;;)
+        {
+            LogCell& cell = gLogger.cells[gLogger.dequeuePosition & (LOG_RING_CAPACITY - 1)];
+            if (cell.sequence.load(std::memory_order_acquire) != gLogger.dequeuePosition + 1)
+                break;
+
+            char prefix[48];
+            snprintf(prefix, sizeof(prefix), "[%10.3f] %-7s ", cell.time, levelNames[cell.level]);
+            batch += prefix;
+            batch += cell.text;
+            batch += '\n';
+
+            // Hand the cell back to the producers for the next lap of the ring
+            cell.sequence.store(gLogger.dequeuePosition + LOG_RING_CAPACITY, std::memory_order_release);
+            ++gLogger.dequeuePosition;
+        }
+
+        if (!batch.empty())
+        {
+            fwrite(batch.data(), 1, batch.size(), stdout);
+            fflush(stdout);
+        }
+        else if (!isRunning)
+        {
+            break;
+        }
+        else
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+    }
+}
+
+
+
+// Creates (or recreates) an offscreen color + depth target
+void UCreateRenderTarget(RenderTarget& target, int width, int height)
+{
+    UDestroyRenderTarget(target);
+
+    target.width = width;
+    target.height = height;
+    target.renderWidth = width;
+    target.renderHeight = height;
+
+    target.colorTexture = UCreateGpuTexture(gGpuResources, { GL_TEXTURE_2D, 1, GL_RGBA8, width, height }, "scene color");
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    // Depth is sampled by the Hi-Z build, so it is a texture rather than a renderbuffer
+    target.depthTexture = UCreateGpuTexture(gGpuResources, { GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT32F, width, height }, "scene depth");
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    target.fbo = UCreateGpuObject(gGpuResources, GPU_RESOURCE_FRAMEBUFFER, "scene");
+    glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target.colorTexture, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, target.depthTexture, 0);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+        ULOG_ERROR("ERROR::FRAMEBUFFER::INCOMPLETE");
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+
+void UDestroyRenderTarget(RenderTarget& target)
+{
+    target.fbo.reset();
+    target.colorTexture.reset();
+    target.depthTexture.reset();
+    target = RenderTarget();
+}
+
+
+// Creates (or recreates) the Hi-Z pyramid for the given depth size, and the stats buffers on first use
+void UCreateOcclusionCuller(OcclusionCuller& culler, int width, int height)
+{
+    culler.hiZTexture.reset();
+
+    culler.hiZWidth = width;
+    culler.hiZHeight = height;
+    culler.hiZLevels = 1;
+    for (int size = std::max(width, height); size > 1; size /= 2)
+        ++culler.hiZLevels;
+
+    culler.hiZTexture = UCreateGpuTexture(gGpuResources, { GL_TEXTURE_2D, culler.hiZLevels, GL_R32F, width, height }, "Hi-Z pyramid");
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    if (culler.statsBuffer == 0)
+    {
+        culler.statsBuffer = UCreateGpuBuffer(gGpuResources, GL_SHADER_STORAGE_BUFFER, 3 * sizeof(GLuint), NULL, GL_DYNAMIC_COPY, "culling stats");
+        for (GpuHandle& buffer : culler.statsReadback)
+            buffer = UCreateGpuBuffer(gGpuResources, GL_SHADER_STORAGE_BUFFER, 3 * sizeof(GLuint), NULL, GL_STREAM_READ, "culling stats readback");
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+}
+
+
+// Grows the per-object buffers to hold objectCount objects. New buffers start with nothing visible,
+// so the first frame draws everything in phase 2.
+void UReserveOcclusionCuller(OcclusionCuller& culler, size_t objectCount)
+{
+    if (objectCount <= culler.capacity)
+        return;
+
+    culler.objectBuffer.reset();
+    culler.visibilityBuffer.reset();
+    culler.phase1Commands.reset();
+    culler.phase2Commands.reset();
+    culler.phase1Counts.reset();
+    culler.phase2Counts.reset();
+
+    culler.capacity = objectCount;
+
+    std::vector<GLuint> zeroVisibility(objectCount, 0);
+    std::vector<DrawArraysIndirectCommand> zeroCommands(objectCount, DrawArraysIndirectCommand{ 0, 0, 0, 0 });
+
+    culler.objectBuffer = UCreateGpuBuffer(gGpuResources, GL_SHADER_STORAGE_BUFFER, objectCount * sizeof(GpuObjectData), NULL, GL_DYNAMIC_DRAW, "culling objects");
+    culler.visibilityBuffer = UCreateGpuBuffer(gGpuResources, GL_SHADER_STORAGE_BUFFER, objectCount * sizeof(GLuint), zeroVisibility.data(), GL_DYNAMIC_COPY, "culling visibility");
+    culler.phase1Commands = UCreateGpuBuffer(gGpuResources, GL_SHADER_STORAGE_BUFFER, objectCount * sizeof(DrawArraysIndirectCommand), zeroCommands.data(), GL_DYNAMIC_COPY, "phase 1 draws");
+    culler.phase2Commands = UCreateGpuBuffer(gGpuResources, GL_SHADER_STORAGE_BUFFER, objectCount * sizeof(DrawArraysIndirectCommand), zeroCommands.data(), GL_DYNAMIC_COPY, "phase 2 draws");
+    culler.phase1Counts = UCreateGpuBuffer(gGpuResources, GL_SHADER_STORAGE_BUFFER, objectCount * sizeof(GLuint), zeroVisibility.data(), GL_DYNAMIC_COPY, "phase 1 draw counts");
+    culler.phase2Counts = UCreateGpuBuffer(gGpuResources, GL_SHADER_STORAGE_BUFFER, objectCount * sizeof(GLuint), zeroVisibility.data(), GL_DYNAMIC_COPY, "phase 2 draw counts");
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+
+void UDestroyOcclusionCuller(OcclusionCuller& culler)
+{
+    culler.objectBuffer.reset();
+    culler.visibilityBuffer.reset();
+    culler.phase1Commands.reset();
+    culler.phase2Commands.reset();
+    culler.phase1Counts.reset();
+    culler.phase2Counts.reset();
+    culler.statsBuffer.reset();
+    for (GpuHandle& buffer : culler.statsReadback)
+        buffer.reset();
+    culler.hiZTexture.reset();
+
+    for (GLsync fence : culler.statsFences)
+    {
+        if (fence)
+            glDeleteSync(fence);
+    }
+
+    culler = OcclusionCuller();
+}
+
+void UCreateMesh(GLMesh& mesh, GLMesh& cylinder, GLMesh& sphere)
+{
+    GLfloat verts[] = {
+        // First Rectangle
+      // Front face
+      -0.5f,  0.5f,  0.5f, 1.0f, 0.0f, 0.0f, 1.0f,   // Top left
+      0.5f,  0.5f,  0.5f, 1.0f, 0.0f, 0.0f, 1.0f,   // Top right
+      0.5f, -0.5f,  0.5f, 1.0f, 0.0f, 0.0f, 1.0f,   // Bottom right
+      0.5f, -0.5f,  0.5f, 1.0f, 0.0f, 0.0f, 1.0f,   // Bottom right
+      -0.5f, -0.5f,  0.5f, 1.0f, 0.0f, 0.0f, 1.0f,   // Bottom left
+      -0.5f,  0.5f,  0.5f, 1.0f, 0.0f, 0.0f, 1.0f,   // Top left
+
+      // Right face
+      0.5f,  0.5f,  0.5f, 0.0f, 1.0f, 0.0f, 1.0f,   // Top left
       0.5f,  0.5f, -0.5f, 0.0f, 1.0f, 0.0f, 1.0f,   // Top right
       0.5f, -0.5f, -0.5f, 0.0f, 1.0f, 0.0f, 1.0f,   // Bottom right
       0.5f, -0.5f, -0.5f, 0.0f, 1.0f, 0.0f, 1.0f,   // Bottom right
       0.5f, -0.5f,  0.5f, 0.0f, 1.0f, 0.0f, 1.0f,   // Bottom left
       0.5f,  0.5f,  0.5f, 0.0f, 1.0f, 0.0f, 1.0f,   // Top left
 
-      // Back face
-      -0.5f,  0.5f, -0.5f, 0.0f, 0.0f, 1.0f, 1.0f,   // Top left
-      0.5f,  0.5f, -0.5f, 0.0f, 0.0f, 1.0f, 1.0f,   // Top right
-      0.5f, -0.5f, -0.5f, 0.0f, 0.0f, 1.0f, 1.0f,   // Bottom right
-      0.5f, -0.5f, -0.5f, 0.0f, 0.0f, 1.0f, 1.0f,   // Bottom right
-      -0.5f, -0.5f, -0.5f, 0.0f, 0.0f, 1.0f, 1.0f,   // Bottom left
-      -0.5f,  0.5f, -0.5f, 0.0f, 0.0f, 1.0f, 1.0f,   // Top left
+      // Back face
+      -0.5f,  0.5f, -0.5f, 0.0f, 0.0f, 1.0f, 1.0f,   // Top left
+      0.5f,  0.5f, -0.5f, 0.0f, 0.0f, 1.0f, 1.0f,   // Top right
+      0.5f, -0.5f, -0.5f, 0.0f, 0.0f, 1.0f, 1.0f,   // Bottom right
+      0.5f, -0.5f, -0.5f, 0.0f, 0.0f, 1.0f, 1.0f,   // Bottom right
+      -0.5f, -0.5f, -0.5f, 0.0f, 0.0f, 1.0f, 1.0f,   // Bottom left
+      -0.5f,  0.5f, -0.5f, 0.0f, 0.0f, 1.0f, 1.0f,   // Top left
+
+      // Left face
+      -0.5f,  0.5f, -0.5f, 1.0f, 1.0f, 0.0f, 1.0f,   // Top right
+      -0.5f,  0.5f,  0.5f, 1.0f, 1.0f, 0.0f, 1.0f,   // Top left
+      -0.5f, -0.5f,  0.5f, 1.0f, 1.0f, 0.0f, 1.0f,   // Bottom left
+      -0.5f, -0.5f,  0.5f, 1.0f, 1.0f, 0.0f, 1.0f,   // Bottom left
+      -0.5f, -0.5f, -0.5f, 1.0f, 1.0f, 0.0f, 1.0f,   // Bottom right
+      -0.5f,  0.5f, -0.5f, 1.0f, 1.0f, 0.0f, 1.0f,   // Top right
+
+      // Top face
+      -0.5f,  0.5f, -0.5f, 1.0f, 0.0f, 1.0f, 1.0f,   // Bottom left
+      0.5f,  0.5f, -0.5f, 1.0f, 0.0f, 1.0f, 1.0f,   // Bottom right
+      0.5f,  0.5f,  0.5f, 1.0f, 0.0f, 1.0f, 1.0f,   // Top right
+      0.5f,  0.5f,  0.5f, 1.0f, 0.0f, 1.0f, 1.0f,   // Top right
+      -0.5f,  0.5f,  0.5f, 1.0f, 0.0f, 1.0f, 1.0f,   // Top left
+      -0.5f,  0.5f, -0.5f, 1.0f, 0.0f, 1.0f, 1.0f,   // Bottom left
+
+      // Bottom face
+      -0.5f, -0.5f, -0.5f, 1.0f, 1.0f, 0.0f, 1.0f,   // Top left
+      0.5f, -0.5f, -0.5f, 1.0f, 1.0f, 0.0f, 1.0f,   // Top right
+      0.5f, -0.5f,  0.5f, 1.0f, 1.0f, 0.0f, 1.0f,   // Bottom right
+      0.5f, -0.5f,  0.5f, 1.0f, 1.0f, 0.0f, 1.0f,   // Bottom right
+      -0.5f, -0.5f,  0.5f, 1.0f, 1.0f, 0.0f, 1.0f,   // Bottom left
+      -0.5f, -0.5f, -0.5f, 1.0f, 1.0f, 0.0f, 1.0f    // Top left
+    };
+
+    // Attribute 2 (texture coordinates) reads the two floats after the normal
+    mesh.vertices.assign(verts, verts + sizeof(verts) / sizeof(GLfloat));
+    mesh.hasTextureCoordinates = true;
+    mesh.nVertices = sizeof(verts) / (7 * sizeof(GLfloat));
+    mesh.boundsMin = glm::vec3(-0.5f);
+    mesh.boundsMax = glm::vec3(0.5f);
+
+    // Generate vertices for the cylinder
+    std::vector<GLfloat> cylVerts; // Holds cylinder vertices
+    int numSegments = 100;
+    float radius = 0.5f;
+    float height = 1.0f;
+
+    for (int i = 0; i <= numSegments; ++i)
+    {
+        float angle = glm::radians((float)i / (float)numSegments * 360.0f);
+        float x = cos(angle) * radius;
+        float z = sin(angle) * radius;
+
+        // Top vertex
+        cylVerts.push_back(x);
+        cylVerts.push_back(0.5f * height);
+        cylVerts.push_back(z);
+        cylVerts.push_back(0.5f);
+        cylVerts.push_back(0.5f);
+        cylVerts.push_back(0.5f);
+        cylVerts.push_back(1.0f);
+
+        // Bottom vertex
+        cylVerts.push_back(x);
+        cylVerts.push_back(-0.5f * height);
+        cylVerts.push_back(z);
+        cylVerts.push_back(0.5f);
+        cylVerts.push_back(0.5f);
+        cylVerts.push_back(0.5f);
+        cylVerts.push_back(1.0f);
+    }
+
+    cylinder.vertices.swap(cylVerts);
+    cylinder.hasTextureCoordinates = false;
+
+    cylinder.nVertices = cylinder.vertices.size() / 7;
+    cylinder.boundsMin = glm::vec3(-radius, -0.5f * height, -radius);
+    cylinder.boundsMax = glm::vec3(radius, 0.5f * height, radius);
+
+    // Generate vertices for the sphere
+    std::vector<GLfloat> sphereVerts; // Holds sphere vertices
+
+    for (int lat = 0; lat <= numSegments; ++lat)
+    {
+        float theta = glm::radians((float)lat / (float)numSegments * 180.0f);
+        float sinTheta = sin(theta);
+        float cosTheta = cos(theta);
+
+        for (int lon = 0; lon <= numSegments; ++lon)
+        {
+            float phi = glm::radians((float)lon / (float)numSegments * 360.0f);
+            float sinPhi = sin(phi);
+            float cosPhi = cos(phi);
+
+            float x = cosPhi * sinTheta;
+            float y = cosTheta;
+            float z = sinPhi * sinTheta;
+
+            sphereVerts.push_back(radius * x);
+            sphereVerts.push_back(radius * y);
+            sphereVerts.push_back(radius * z);
+            sphereVerts.push_back(0.5f);
+            sphereVerts.push_back(0.5f);
+            sphereVerts.push_back(0.5f);
+            sphereVerts.push_back(1.0f);
+        }
+    }
+
+    sphere.vertices.swap(sphereVerts);
+    sphere.hasTextureCoordinates = false;
+
+    sphere.nVertices = sphere.vertices.size() / 7;
+    sphere.boundsMin = glm::vec3(-radius);
+    sphere.boundsMax = glm::vec3(radius);
+}
+
+
+// Uploads the meshes built by UCreateMesh into one vertex buffer and records where each one starts
+void UCreateSceneGeometry(SceneGeometry& geometry, const std::vector<GLMesh*>& meshes)
+{
+    std::vector<GLfloat> vertices;
+    for (GLMesh* mesh : meshes)
+    {
+        mesh->firstVertex = (GLint)(vertices.size() / 7);
+        vertices.insert(vertices.end(), mesh->vertices.begin(), mesh->vertices.end());
+    }
+    // Attribute 2 of the last vertex reads one float past it
+    vertices.push_back(0.0f);
+
+    geometry.vao = UCreateGpuObject(gGpuResources, GPU_RESOURCE_VERTEX_ARRAY, "scene");
+    glBindVertexArray(geometry.vao);
+    geometry.vbo = UCreateGpuBuffer(gGpuResources, GL_ARRAY_BUFFER, vertices.size() * sizeof(GLfloat), vertices.data(), GL_STATIC_DRAW, "scene vertices");
+
+    // Position, then the normal, then the texture coordinates; meshes without them only ever get
+    // untextured materials, whose variants don't read attribute 2
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 7 * sizeof(GLfloat), (GLvoid*)0);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 7 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 7 * sizeof(GLfloat), (GLvoid*)(6 * sizeof(GLfloat)));
+    glEnableVertexAttribArray(2);
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+
+    UReserveObjectIndices(geometry, 16);
+}
+
+
+// Grows the object index attribute to cover objectCount objects. The buffer keeps its name, so the
+// VAO set up here stays valid.
+void UReserveObjectIndices(SceneGeometry& geometry, size_t objectCount)
+{
+    if (objectCount <= geometry.objectIndexCapacity)
+        return;
+
+    size_t capacity = std::max(objectCount, geometry.objectIndexCapacity * 2);
+    std::vector<GLuint> indices(capacity);
+    for (size_t i = 0; i < capacity; ++i)
+        indices[i] = (GLuint)i;
+
+    if (geometry.objectIndexBuffer == 0)
+    {
+        geometry.objectIndexBuffer = UCreateGpuBuffer(gGpuResources, GL_ARRAY_BUFFER, capacity * sizeof(GLuint), indices.data(), GL_STATIC_DRAW, "object indices");
+
+        glBindVertexArray(geometry.vao);
+        glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, sizeof(GLuint), (GLvoid*)0);
+        glVertexAttribDivisor(3, 1);
+        glEnableVertexAttribArray(3);
+        glBindVertexArray(0);
+    }
+    else
+    {
+        UResizeGpuBuffer(gGpuResources, geometry.objectIndexBuffer, GL_ARRAY_BUFFER, capacity * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    geometry.objectIndexCapacity = capacity;
+}
+
+
+void UDestroySceneGeometry(SceneGeometry& geometry)
+{
+    geometry.vao.reset();
+    geometry.vbo.reset();
+    geometry.objectIndexBuffer.reset();
+    geometry = SceneGeometry();
+}
+
+
+// Reads a whole text file; returns false if it can't be opened
+bool UReadTextFile(const std::string& path, std::string& text)
+{
+    std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+    if (!file)
+        return false;
+
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    text = contents.str();
+    return true;
+}
+
+
+// Prepares background compilation and starts watching the shader directory
+void UCreateShaderManager(ShaderManager& manager)
+{
+    // With KHR_parallel_shader_compile compiles and links return immediately and finish on driver threads
+    manager.hasParallelCompile = GLEW_KHR_parallel_shader_compile != 0;
+    if (manager.hasParallelCompile)
+        glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+    else
+        ULOG_WARNING("KHR_parallel_shader_compile is not supported, shaders compile on the render thread");
+
+#ifdef __linux__
+    // Editors save either in place or by renaming a temporary file over the original
+    manager.inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (manager.inotifyFd >= 0)
+        manager.watchDescriptor = inotify_add_watch(manager.inotifyFd, SHADER_DIRECTORY, IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (manager.watchDescriptor < 0)
+        ULOG_WARNING("Shader hot reload is unavailable: cannot watch %s", SHADER_DIRECTORY);
+#endif
+}
+
+
+void UDestroyShaderManager(ShaderManager& manager)
+{
+#ifdef __linux__
+    if (manager.inotifyFd >= 0)
+        close(manager.inotifyFd);
+#endif
+
+    for (ManagedProgram& program : manager.programs)
+    {
+        for (GLuint shaderId : program.pendingShaderIds)
+            glDeleteShader(shaderId);
+        program.pendingProgramId.reset();
+        program.programId->reset();
+    }
+
+    manager = ShaderManager();
+}
+
+
+// Registers a program built from files in SHADER_DIRECTORY and starts compiling it. programId receives
+// the program once it links, and keeps the last good program across reloads. defines are added to
+// every stage right after its #version line.
+void UAddShaderProgram(ShaderManager& manager, const char* name, const std::vector<ShaderStage>& stages, GpuHandle& programId, const std::string& defines)
+{
+    ManagedProgram program;
+    program.name = name;
+    program.stages = stages;
+    program.defines = defines;
+    program.programId = &programId;
+    manager.programs.push_back(std::move(program));
+
+    USubmitShaderProgram(manager.programs.back());
+}
+
+
+// Reads the program's files and issues the compile and link. Nothing here waits for the driver.
+bool USubmitShaderProgram(ManagedProgram& program)
+{
+    std::vector<std::string> sources(program.stages.size());
+    for (size_t i = 0; i < program.stages.size(); ++i)
+    {
+        std::string path = std::string(SHADER_DIRECTORY) + program.stages[i].fileName;
+        if (!UReadTextFile(path, sources[i]))
+        {
+            ULOG_ERROR("ERROR::SHADER::FILE_NOT_READ %s", path.c_str());
+            return false;
+        }
+
+        // #version has to stay the first line
+        size_t versionEnd = sources[i].find('\n');
+        sources[i].insert(versionEnd == std::string::npos ? sources[i].size() : versionEnd + 1, program.defines);
+    }
+
+    program.pendingProgramId = UCreateGpuObject(gGpuResources, GPU_RESOURCE_PROGRAM, program.name.c_str());
+    for (size_t i = 0; i < program.stages.size(); ++i)
+    {
+        const char* source = sources[i].c_str();
+        GLuint shaderId = glCreateShader(program.stages[i].type);
+        glShaderSource(shaderId, 1, &source, NULL);
+        glCompileShader(shaderId);
+        glAttachShader(program.pendingProgramId, shaderId);
+        program.pendingShaderIds.push_back(shaderId);
+    }
+
+    // Linking may be issued before the compiles finish; a failed compile shows up as a failed link
+    glLinkProgram(program.pendingProgramId);
+    return true;
+}
+
+
+// Finishes a pending compile once the driver reports it complete (or right away if wait is set).
+// On success the new program replaces the old one; on failure the old one stays in use.
+// Returns false while the compile is still running.
+bool UPollShaderProgram(const ShaderManager& manager, ManagedProgram& program, bool wait)
+{
+    if (program.pendingProgramId == 0)
+        return true;
+
+    if (manager.hasParallelCompile && !wait)
+    {
+        GLint isComplete = GL_FALSE;
+        glGetProgramiv(program.pendingProgramId, GL_COMPLETION_STATUS_KHR, &isComplete);
+        if (!isComplete)
+            return false;
+    }
+
+    // Compilation and linkage error reporting
+    int success = 0;
+    char infoLog[512];
+
+    glGetProgramiv(program.pendingProgramId, GL_LINK_STATUS, &success);
+    if (success)
+    {
+        // Detached, the shader objects are freed below instead of living as long as the program
+        for (GLuint shaderId : program.pendingShaderIds)
+            glDetachShader(program.pendingProgramId, shaderId);
+
+        *program.programId = std::move(program.pendingProgramId);
+        gRedraw.dirty |= REDRAW_SHADERS;
+        ULOG_INFO("Shader program %s ready", program.name.c_str());
+    }
+    else
+    {
+        for (size_t i = 0; i < program.pendingShaderIds.size(); ++i)
+        {
+            glGetShaderiv(program.pendingShaderIds[i], GL_COMPILE_STATUS, &success);
+            if (!success)
+            {
+                glGetShaderInfoLog(program.pendingShaderIds[i], sizeof(infoLog), NULL, infoLog);
+                ULOG_ERROR("ERROR::SHADER::%s::COMPILATION_FAILED\n%s", program.stages[i].fileName, infoLog);
+            }
+        }
+
+        glGetProgramInfoLog(program.pendingProgramId, sizeof(infoLog), NULL, infoLog);
+        ULOG_ERROR("ERROR::SHADER::PROGRAM::LINKING_FAILED %s\n%s", program.name.c_str(), infoLog);
+
+        program.pendingProgramId.reset();
+    }
+
+    // The program keeps the compiled code. The shaders are unattached by now (deleting a failed program
+    // detaches them), so deleting them frees them right away.
+    for (GLuint shaderId : program.pendingShaderIds)
+        glDeleteShader(shaderId);
+    program.pendingShaderIds.clear();
+
+    // Files saved while this compile was running
+    if (program.isReloadRequested)
+    {
+        program.isReloadRequested = false;
+        USubmitShaderProgram(program);
+    }
+
+    return true;
+}
+
+
+// Blocks until every pending program has finished; returns false if any program has never linked
+bool UWaitForShaderPrograms(ShaderManager& manager)
+{
+    bool isComplete = true;
+    for (ManagedProgram& program : manager.programs)
+    {
+        UPollShaderProgram(manager, program, true);
+
+        if (*program.programId == 0)
+        {
+            ULOG_ERROR("Shader program %s failed to build", program.name.c_str());
+            isComplete = false;
+        }
+    }
+    return isComplete;
+}
+
+
+// Per frame: queues reloads for changed shader files and swaps in programs that finished compiling
+void UUpdateShaderManager(ShaderManager& manager)
+{
+#ifdef __linux__
+    if (manager.inotifyFd >= 0)
+    {
+        alignas(struct inotify_event) char buffer[4096];
+        ssize_t length;
+        while ((length = read(manager.inotifyFd, buffer, sizeof(buffer))) > 0)
+        {
+            for (char* entry = buffer; entry < buffer + length; )
+            {
+                const struct inotify_event* event = (const struct inotify_event*)entry;
+                entry += sizeof(struct inotify_event) + event->len;
+
+                if (event->len == 0)
+                    continue;
+
+                for (ManagedProgram& program : manager.programs)
+                {
+                    for (const ShaderStage& stage : program.stages)
+                    {
+                        if (strcmp(stage.fileName, event->name) != 0)
+                            continue;
+
+                        if (program.pendingProgramId != 0)
+                            program.isReloadRequested = true;
+                        else
+                            USubmitShaderProgram(program);
+                        break;
+                    }
+                }
+            }
+        }
+    }
+#endif
+
+    for (ManagedProgram& program : manager.programs)
+        UPollShaderProgram(manager, program, false);
+}
+
+// Drops flags that have no effect without another one, so equivalent requests share a variant
+unsigned UNormalizeShaderFeatures(unsigned features)
+{
+    if (!(features & SHADER_FEATURE_LIT))
+        features &= ~SHADER_FEATURE_SPECULAR;
+    if (!(features & SHADER_FEATURE_TEXTURED))
+        features &= ~SHADER_FEATURE_ALPHA_TEST;
+    return features;
+}
+
+
+// Returns the program for a feature combination, compiling it the first time it is asked for.
+// Returns 0 while that first compile is still running.
+GLuint UGetShaderVariant(ShaderManager& manager, ShaderPermutations& permutations, unsigned features)
+{
+    features = UNormalizeShaderFeatures(features);
+
+    std::map<unsigned, GpuHandle>::iterator variant = permutations.variants.find(features);
+    if (variant != permutations.variants.end())
+        return variant->second;
+
+    std::string name = permutations.name;
+    std::string defines = permutations.defines;
+    for (int i = 0; i < SHADER_FEATURE_COUNT; ++i)
+    {
+        if (features & (1u << i))
+        {
+            name += name.size() > strlen(permutations.name) ? "|" : "[";
+            name += SHADER_FEATURE_DEFINES[i];
+            defines += std::string("#define ") + SHADER_FEATURE_DEFINES[i] + "\n";
+        }
+    }
+    if (name.size() > strlen(permutations.name))
+        name += "]";
+
+    // Map nodes don't move, so the manager can keep a pointer to the cached id
+    GpuHandle& programId = permutations.variants[features];
+    UAddShaderProgram(manager, name.c_str(), permutations.stages, programId, defines);
+
+    UProfilerSet("shader.variants", (double)permutations.variants.size());
+    return programId;
+}
+
+// Loads every material texture and sets up samplers, bindless handles and the material buffers
+bool UCreateMaterials(MaterialSystem& system)
+{
+    if (!UCreateTextureArrays(system))
+        return false;
+
+    for (size_t i = 0; i < system.materials.size(); ++i)
+    {
+        system.materials[i]->index = (GLuint)i;
+        UResolveMaterialTexture(system, *system.materials[i]);
+    }
+
+    system.materialBuffer = UCreateGpuBuffer(gGpuResources, GL_SHADER_STORAGE_BUFFER, system.materials.size() * sizeof(GpuMaterialData), NULL, GL_DYNAMIC_DRAW, "materials");
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    system.isDirty = true;
+
+    ULOG_INFO("Materials: %d, texture arrays: %d, %s", (int)system.materials.size(), (int)system.textureArrays.size(),
+        system.hasBindless ? "bindless handles" : "bound array units");
+    return true;
+}
+
+
+void UDestroyMaterials(MaterialSystem& system)
+{
+    for (const std::pair<const std::pair<GLuint, GLuint>, GLuint64>& handle : system.handles)
+        glMakeTextureHandleNonResidentARB(handle.second);
+
+    for (std::pair<const GLint, GpuHandle>& sampler : system.samplers)
+        sampler.second.reset();
+
+    for (TextureArray& textureArray : system.textureArrays)
+        textureArray.textureId.reset();
+
+    system.materialBuffer.reset();
+
+    system.handles.clear();
+    system.samplers.clear();
+    system.textureArrays.clear();
+}
+
+
+// Packs the material textures into GL_TEXTURE_2D_ARRAYs, one per image size, one layer per file
+bool UCreateTextureArrays(MaterialSystem& system)
+{
+    std::vector<LoadedTexture> textures;
+    bool isLoaded = true;
+
+    for (Material* material : system.materials)
+    {
+        if (!(material->features & SHADER_FEATURE_TEXTURED))
+            continue;
+
+        size_t t = 0;
+        while (t < textures.size() && textures[t].fileName != material->textureFile)
+            ++t;
+        material->textureArray = (int)t; // Index into textures until the arrays are assigned below
+
+        if (t < textures.size())
+            continue;
+
+        // Every layer is RGBA8 so any image can share an array with others of its size
+        LoadedTexture texture;
+        int channels;
+        texture.fileName = material->textureFile;
+        texture.pixels = stbi_load(material->textureFile, &texture.width, &texture.height, &channels, 4);
+        if (!texture.pixels)
+        {
+            ULOG_ERROR("Failed to load texture %s", material->textureFile);
+            isLoaded = false;
+            break;
+        }
+        flipImageVertically(texture.pixels, texture.width, texture.height, 4);
+        textures.push_back(texture);
+    }
+
+    // Same-size images go into the same array
+    for (LoadedTexture& texture : textures)
+    {
+        size_t a = 0;
+        while (a < system.textureArrays.size() &&
+            (system.textureArrays[a].width != texture.width || system.textureArrays[a].height != texture.height))
+            ++a;
+
+        if (a == system.textureArrays.size())
+        {
+            TextureArray textureArray;
+            textureArray.width = texture.width;
+            textureArray.height = texture.height;
+            system.textureArrays.push_back(std::move(textureArray));
+        }
+
+        texture.textureArray = (int)a;
+        texture.layer = system.textureArrays[a].layers++;
+    }
+
+    // Without bindless handles every array needs its own texture unit
+    if (isLoaded && !system.hasBindless && system.textureArrays.size() > (size_t)MAX_TEXTURE_ARRAYS)
+    {
+        ULOG_ERROR("%d texture sizes in use, at most %d are supported without bindless textures", (int)system.textureArrays.size(), MAX_TEXTURE_ARRAYS);
+        isLoaded = false;
+    }
+
+    if (isLoaded)
+    {
+        for (TextureArray& textureArray : system.textureArrays)
+        {
+            GLsizei levels = 1 + (GLsizei)std::floor(std::log2((float)std::max(textureArray.width, textureArray.height)));
+
+            GpuTextureDesc desc = { GL_TEXTURE_2D_ARRAY, levels, GL_RGBA8, textureArray.width, textureArray.height, textureArray.layers };
+            textureArray.textureId = UCreateGpuTexture(gGpuResources, desc, "material textures");
+        }
+
+        for (const LoadedTexture& texture : textures)
+        {
+            glBindTexture(GL_TEXTURE_2D_ARRAY, system.textureArrays[texture.textureArray].textureId);
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, texture.layer, texture.width, texture.height, 1, GL_RGBA, GL_UNSIGNED_BYTE, texture.pixels);
+        }
+
+        for (const TextureArray& textureArray : system.textureArrays)
+        {
+            glBindTexture(GL_TEXTURE_2D_ARRAY, textureArray.textureId);
+            glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+        }
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+        for (Material* material : system.materials)
+        {
+            if (!(material->features & SHADER_FEATURE_TEXTURED))
+                continue;
+
+            const LoadedTexture& texture = textures[material->textureArray];
+            material->textureArray = texture.textureArray;
+            material->textureLayer = texture.layer;
+        }
+    }
+
+    for (const LoadedTexture& texture : textures)
+        stbi_image_free(texture.pixels);
+
+    return isLoaded;
+}
+
+
+// Shared sampler object for a wrap mode
+GLuint UGetSampler(MaterialSystem& system, GLint wrapMode)
+{
+    std::map<GLint, GpuHandle>::iterator sampler = system.samplers.find(wrapMode);
+    if (sampler != system.samplers.end())
+        return sampler->second;
+
+    GpuHandle& samplerId = system.samplers[wrapMode];
+    samplerId = UCreateGpuObject(gGpuResources, GPU_RESOURCE_SAMPLER, "material");
+
+    // set the texture wrapping parameters
+    glSamplerParameteri(samplerId, GL_TEXTURE_WRAP_S, wrapMode);
+    glSamplerParameteri(samplerId, GL_TEXTURE_WRAP_T, wrapMode);
+    if (wrapMode == GL_CLAMP_TO_BORDER)
+    {
+        float color[] = { 1.0f, 0.0f, 1.0f, 1.0f };
+        glSamplerParameterfv(samplerId, GL_TEXTURE_BORDER_COLOR, color);
+    }
+    // set texture filtering parameters; the arrays have full mip chains, so minification is trilinear
+    glSamplerParameteri(samplerId, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glSamplerParameteri(samplerId, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    return samplerId;
+}
+
+
+// Picks the sampler for the material's wrap mode and, with bindless textures, the resident handle
+// for its array and sampler. Call again after changing wrapMode.
+void UResolveMaterialTexture(MaterialSystem& system, Material& material)
+{
+    if (!(material.features & SHADER_FEATURE_TEXTURED))
+        return;
+
+    material.samplerId = UGetSampler(system, material.wrapMode);
+    system.isDirty = true;
+
+    if (!system.hasBindless)
+        return;
+
+    // A handle freezes its texture and sampler state, so each pair gets its own handle
+    std::pair<GLuint, GLuint> key(system.textureArrays[material.textureArray].textureId, material.samplerId);
+    std::map<std::pair<GLuint, GLuint>, GLuint64>::iterator handle = system.handles.find(key);
+    if (handle == system.handles.end())
+    {
+        GLuint64 textureHandle = glGetTextureSamplerHandleARB(key.first, key.second);
+        glMakeTextureHandleResidentARB(textureHandle);
+        UMarkGpuResourceUnpoolable(gGpuResources, GPU_RESOURCE_TEXTURE, key.first);
+        handle = system.handles.insert(std::make_pair(key, textureHandle)).first;
+    }
+    material.textureHandle = handle->second;
+}
+
+
+// Writes the material buffer if any material changed since the last upload
+void UUploadMaterials(MaterialSystem& system)
+{
+    if (!system.isDirty)
+        return;
+
+    std::vector<GpuMaterialData> materialData(system.materials.size());
+    for (size_t i = 0; i < system.materials.size(); ++i)
+    {
+        const Material& material = *system.materials[i];
+        materialData[i].color = glm::vec4(material.color, material.alphaCutoff);
+        materialData[i].uvScale = material.uvScale;
+        materialData[i].textureArray = material.textureArray;
+        materialData[i].textureLayer = material.textureLayer;
+        materialData[i].textureHandle = material.textureHandle;
+        materialData[i].padding = 0;
+    }
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, system.materialBuffer);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, materialData.size() * sizeof(GpuMaterialData), materialData.data());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    system.isDirty = false;
+}
+
+
+// Binds what every surface draw shares: the material buffer and, without bindless handles, the texture arrays
+void UBindMaterials(const MaterialSystem& system)
+{
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, system.materialBuffer);
+
+    if (system.hasBindless)
+        return;
+
+    for (size_t i = 0; i < system.textureArrays.size(); ++i)
+    {
+        glActiveTexture(GL_TEXTURE0 + MATERIAL_TEXTURE_UNIT + (GLenum)i);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, system.textureArrays[i].textureId);
+    }
+    glActiveTexture(GL_TEXTURE0);
+}
+
+// Bytes of immutable storage for a texture, all levels included
+size_t UGpuTextureBytes(const GpuTextureDesc& desc)
+{
+    size_t bytesPerTexel;
+    switch (desc.internalFormat)
+    {
+    case GL_R8:
+        bytesPerTexel = 1;
+        break;
+    case GL_RGBA16F:
+        bytesPerTexel = 8;
+        break;
+    case GL_RGBA32F:
+        bytesPerTexel = 16;
+        break;
+    default: // GL_RGBA8, GL_R32F, GL_DEPTH_COMPONENT32F
+        bytesPerTexel = 4;
+        break;
+    }
+
+    size_t faces = desc.target == GL_TEXTURE_CUBE_MAP ? 6 : 1;
+    size_t bytes = 0;
+    for (GLsizei level = 0; level < desc.levels; ++level)
+    {
+        size_t width = std::max(desc.width >> level, 1);
+        size_t height = std::max(desc.height >> level, 1);
+        bytes += width * height * desc.depth * faces * bytesPerTexel;
+    }
+    return bytes;
+}
+
+
+void UTrackGpuResource(GpuResourceRegistry& registry, GpuResourceType type, GLuint id, const GpuResourceInfo& info)
+{
+    registry.live[std::make_pair((int)type, id)] = info;
+    registry.liveCount[type] += 1;
+    registry.liveBytes[type] += info.bytes;
+
+    size_t totalBytes = registry.pooledBytes;
+    for (size_t bytes : registry.liveBytes)
+        totalBytes += bytes;
+    registry.peakBytes = std::max(registry.peakBytes, totalBytes);
+}
+
+
+// Stops tracking a resource and returns what was known about it
+GpuResourceInfo UUntrackGpuResource(GpuResourceRegistry& registry, GpuResourceType type, GLuint id)
+{
+    GpuResourceInfo info;
+    std::map<std::pair<int, GLuint>, GpuResourceInfo>::iterator entry = registry.live.find(std::make_pair((int)type, id));
+    if (entry == registry.live.end())
+    {
+        ULOG_ERROR("GPU resource %s %u was not created through the registry", GPU_RESOURCE_TYPE_NAMES[type], id);
+        return info;
+    }
+
+    info = entry->second;
+    registry.live.erase(entry);
+    registry.liveCount[type] -= 1;
+    registry.liveBytes[type] -= info.bytes;
+    return info;
+}
+
+
+// Creates a buffer of the given size, reusing a pooled one of the same size and usage when there is
+// one. The buffer is left bound to target.
+GpuHandle UCreateGpuBuffer(GpuResourceRegistry& registry, GLenum target, size_t bytes, const void* data, GLenum usage, const char* label)
+{
+    GLuint bufferId;
+    std::pair<size_t, GLenum> key(bytes, usage);
+    std::multimap<std::pair<size_t, GLenum>, PooledGpuResource>::iterator pooled = registry.bufferPool.find(key);
+    if (pooled != registry.bufferPool.end())
+    {
+        bufferId = pooled->second.id;
+        registry.bufferPool.erase(pooled);
+        registry.pooledBytes -= bytes;
+        ++registry.poolHits;
+
+        glBindBuffer(target, bufferId);
+        if (data)
+            glBufferSubData(target, 0, bytes, data);
+    }
+    else
+    {
+        glGenBuffers(1, &bufferId);
+        glBindBuffer(target, bufferId);
+        glBufferData(target, bytes, data, usage);
+        ++registry.poolMisses;
+    }
+
+    GpuResourceInfo info;
+    info.label = label;
+    info.bytes = bytes;
+    info.usage = usage;
+    UTrackGpuResource(registry, GPU_RESOURCE_BUFFER, bufferId, info);
+    return GpuHandle(&registry, GPU_RESOURCE_BUFFER, bufferId);
+}
+
+
+// Reallocates a buffer's storage in place; the name stays valid for VAOs that reference it
+void UResizeGpuBuffer(GpuResourceRegistry& registry, GLuint bufferId, GLenum target, size_t bytes, const void* data, GLenum usage)
+{
+    GpuResourceInfo info = UUntrackGpuResource(registry, GPU_RESOURCE_BUFFER, bufferId);
+
+    glBindBuffer(target, bufferId);
+    glBufferData(target, bytes, data, usage);
+
+    info.bytes = bytes;
+    info.usage = usage;
+    UTrackGpuResource(registry, GPU_RESOURCE_BUFFER, bufferId, info);
+}
+
+
+// Creates a texture with immutable storage, reusing a pooled one with the same description when there
+// is one. The texture is left bound to desc.target with the parameters of a new texture.
+GpuHandle UCreateGpuTexture(GpuResourceRegistry& registry, const GpuTextureDesc& desc, const char* label)
+{
+    GLuint textureId;
+    std::multimap<GpuTextureDesc, PooledGpuResource>::iterator pooled = registry.texturePool.find(desc);
+    if (pooled != registry.texturePool.end())
+    {
+        textureId = pooled->second.id;
+        registry.texturePool.erase(pooled);
+        registry.pooledBytes -= UGpuTextureBytes(desc);
+        ++registry.poolHits;
+
+        // Back to the defaults, so nothing of the previous owner's sampling state carries over
+        glBindTexture(desc.target, textureId);
+        glTexParameteri(desc.target, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_LINEAR);
+        glTexParameteri(desc.target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(desc.target, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(desc.target, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(desc.target, GL_TEXTURE_WRAP_R, GL_REPEAT);
+        glTexParameteri(desc.target, GL_TEXTURE_COMPARE_MODE, GL_NONE);
+        glTexParameteri(desc.target, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+        glTexParameteri(desc.target, GL_TEXTURE_BASE_LEVEL, 0);
+        glTexParameteri(desc.target, GL_TEXTURE_MAX_LEVEL, 1000);
+        glTexParameterf(desc.target, GL_TEXTURE_MIN_LOD, -1000.0f);
+        glTexParameterf(desc.target, GL_TEXTURE_MAX_LOD, 1000.0f);
+        glTexParameterf(desc.target, GL_TEXTURE_LOD_BIAS, 0.0f);
+    }
+    else
+    {
+        glGenTextures(1, &textureId);
+        glBindTexture(desc.target, textureId);
+        if (desc.target == GL_TEXTURE_2D_ARRAY)
+            glTexStorage3D(desc.target, desc.levels, desc.internalFormat, desc.width, desc.height, desc.depth);
+        else
+            glTexStorage2D(desc.target, desc.levels, desc.internalFormat, desc.width, desc.height);
+        ++registry.poolMisses;
+    }
+
+    GpuResourceInfo info;
+    info.label = label;
+    info.bytes = UGpuTextureBytes(desc);
+    info.textureDesc = desc;
+    UTrackGpuResource(registry, GPU_RESOURCE_TEXTURE, textureId, info);
+    return GpuHandle(&registry, GPU_RESOURCE_TEXTURE, textureId);
+}
+
+
+// Creates a vertex array, framebuffer, sampler or program
+GpuHandle UCreateGpuObject(GpuResourceRegistry& registry, GpuResourceType type, const char* label)
+{
+    GLuint id = 0;
+    switch (type)
+    {
+    case GPU_RESOURCE_VERTEX_ARRAY:
+        glGenVertexArrays(1, &id);
+        break;
+    case GPU_RESOURCE_FRAMEBUFFER:
+        glGenFramebuffers(1, &id);
+        break;
+    case GPU_RESOURCE_SAMPLER:
+        glGenSamplers(1, &id);
+        break;
+    case GPU_RESOURCE_PROGRAM:
+        id = glCreateProgram();
+        break;
+    default:
+        ULOG_ERROR("Use UCreateGpuBuffer or UCreateGpuTexture for %s", GPU_RESOURCE_TYPE_NAMES[type]);
+        return GpuHandle();
+    }
+
+    GpuResourceInfo info;
+    info.label = label;
+    UTrackGpuResource(registry, type, id, info);
+    return GpuHandle(&registry, type, id);
+}
+
+
+// Textures with a bindless handle can't have their state changed again, so they are deleted rather
+// than pooled when released
+void UMarkGpuResourceUnpoolable(GpuResourceRegistry& registry, GpuResourceType type, GLuint id)
+{
+    std::map<std::pair<int, GLuint>, GpuResourceInfo>::iterator entry = registry.live.find(std::make_pair((int)type, id));
+    if (entry != registry.live.end())
+        entry->second.isPoolable = false;
+}
+
+
+// Hands a resource back. Buffers and textures are kept for reuse while the pool is under budget;
+// everything else is deleted.
+void UReleaseGpuResource(GpuResourceRegistry& registry, GpuResourceType type, GLuint id)
+{
+    // The context is gone; the resource was already reported as leaked
+    if (registry.isShutDown)
+        return;
+
+    GpuResourceInfo info = UUntrackGpuResource(registry, type, id);
+    bool isPooled = (type == GPU_RESOURCE_BUFFER || type == GPU_RESOURCE_TEXTURE) && info.isPoolable && info.bytes > 0 &&
+        registry.pooledBytes + info.bytes <= registry.poolBudget;
+    if (isPooled)
+    {
+        if (type == GPU_RESOURCE_BUFFER)
+            registry.bufferPool.insert(std::make_pair(std::make_pair(info.bytes, info.usage), PooledGpuResource{ id, registry.frame }));
+        else
+            registry.texturePool.insert(std::make_pair(info.textureDesc, PooledGpuResource{ id, registry.frame }));
+        registry.pooledBytes += info.bytes;
+        return;
+    }
+
+    switch (type)
+    {
+    case GPU_RESOURCE_BUFFER:
+        glDeleteBuffers(1, &id);
+        break;
+    case GPU_RESOURCE_TEXTURE:
+        glDeleteTextures(1, &id);
+        break;
+    case GPU_RESOURCE_VERTEX_ARRAY:
+        glDeleteVertexArrays(1, &id);
+        break;
+    case GPU_RESOURCE_FRAMEBUFFER:
+        glDeleteFramebuffers(1, &id);
+        break;
+    case GPU_RESOURCE_SAMPLER:
+        glDeleteSamplers(1, &id);
+        break;
+    case GPU_RESOURCE_PROGRAM:
+        glDeleteProgram(id);
+        break;
+    default:
+        break;
+    }
+}
+
+
+void GpuHandle::reset()
+{
+    if (id != 0 && registry)
+        UReleaseGpuResource(*registry, type, id);
+    id = 0;
+}
+
+
+// Deletes pooled buffers and textures that were returned before olderThanFrame
+void UTrimGpuResourcePools(GpuResourceRegistry& registry, unsigned long long olderThanFrame)
+{
+    for (std::multimap<std::pair<size_t, GLenum>, PooledGpuResource>::iterator pooled = registry.bufferPool.begin(); pooled != registry.bufferPool.end(); )
+    {
+        if (pooled->second.frame >= olderThanFrame)
+        {
+            ++pooled;
+            continue;
+        }
+
+        glDeleteBuffers(1, &pooled->second.id);
+        registry.pooledBytes -= pooled->first.first;
+        pooled = registry.bufferPool.erase(pooled);
+    }
 
-      // Left face
-      -0.5f,  0.5f, -0.5f, 1.0f, 1.0f, 0.0f, 1.0f,   // Top right
-      -0.5f,  0.5f,  0.5f, 1.0f, 1.0f, 0.0f, 1.0f,   // Top left
-      -0.5f, -0.5f,  0.5f, 1.0f, 1.0f, 0.0f, 1.0f,   // Bottom left
-      -0.5f, -0.5f,  0.5f, 1.0f, 1.0f, 0.0f, 1.0f,   // Bottom left
-      -0.5f, -0.5f, -0.5f, 1.0f, 1.0f, 0.0f, 1.0f,   // Bottom right
-      -0.5f,  0.5f, -0.5f, 1.0f, 1.0f, 0.0f, 1.0f,   // Top right
+    for (std::multimap<GpuTextureDesc, PooledGpuResource>::iterator pooled = registry.texturePool.begin(); pooled != registry.texturePool.end(); )
+    {
+        if (pooled->second.frame >= olderThanFrame)
+        {
+            ++pooled;
+            continue;
+        }
 
-      // Top face
-      -0.5f,  0.5f, -0.5f, 1.0f, 0.0f, 1.0f, 1.0f,   // Bottom left
-      0.5f,  0.5f, -0.5f, 1.0f, 0.0f, 1.0f, 1.0f,   // Bottom right
-      0.5f,  0.5f,  0.5f, 1.0f, 0.0f, 1.0f, 1.0f,   // Top right
-      0.5f,  0.5f,  0.5f, 1.0f, 0.0f, 1.0f, 1.0f,   // Top right
-      -0.5f,  0.5f,  0.5f, 1.0f, 0.0f, 1.0f, 1.0f,   // Top left
-      -0.5f,  0.5f, -0.5f, 1.0f, 0.0f, 1.0f, 1.0f,   // Bottom left
+        glDeleteTextures(1, &pooled->second.id);
+        registry.pooledBytes -= UGpuTextureBytes(pooled->first);
+        pooled = registry.texturePool.erase(pooled);
+    }
+}
 
-      // Bottom face
-      -0.5f, -0.5f, -0.5f, 1.0f, 1.0f, 0.0f, 1.0f,   // Top left
-      0.5f, -0.5f, -0.5f, 1.0f, 1.0f, 0.0f, 1.0f,   // Top right
-      0.5f, -0.5f,  0.5f, 1.0f, 1.0f, 0.0f, 1.0f,   // Bottom right
-      0.5f, -0.5f,  0.5f, 1.0f, 1.0f, 0.0f, 1.0f,   // Bottom right
-      -0.5f, -0.5f,  0.5f, 1.0f, 1.0f, 0.0f, 1.0f,   // Bottom left
-      -0.5f, -0.5f, -0.5f, 1.0f, 1.0f, 0.0f, 1.0f    // Top left
+
+// Per frame: lets go of pooled resources nobody has asked for in a while and publishes the counters
+void UUpdateGpuResources(GpuResourceRegistry& registry)
+{
+    ++registry.frame;
+    if (registry.frame > GPU_POOL_MAX_AGE)
+        UTrimGpuResourcePools(registry, registry.frame - GPU_POOL_MAX_AGE);
+
+    const double megabyte = 1024.0 * 1024.0;
+    size_t totalBytes = registry.pooledBytes;
+    for (int type = 0; type < GPU_RESOURCE_TYPE_COUNT; ++type)
+    {
+        std::string name = std::string("gpu.") + GPU_RESOURCE_TYPE_NAMES[type];
+        UProfilerSet((name + ".count").c_str(), (double)registry.liveCount[type]);
+        if (registry.liveBytes[type] > 0)
+            UProfilerSet((name + ".MB").c_str(), registry.liveBytes[type] / megabyte);
+        totalBytes += registry.liveBytes[type];
+    }
+
+    UProfilerSet("gpu.pooled.MB", registry.pooledBytes / megabyte);
+    UProfilerSet("gpu.total.MB", totalBytes / megabyte);
+    UProfilerSet("gpu.poolHits", (double)registry.poolHits);
+    UProfilerSet("gpu.poolMisses", (double)registry.poolMisses);
+}
+
+
+// Frees the pools and reports every resource still alive; call after all the other destroy functions
+// and before the context goes away. Handles released later only drop their name.
+// Returns the number of leaked resources.
+size_t UDestroyGpuResourceRegistry(GpuResourceRegistry& registry)
+{
+    UTrimGpuResourcePools(registry, ~0ull);
+
+    for (const std::pair<const std::pair<int, GLuint>, GpuResourceInfo>& entry : registry.live)
+    {
+        ULOG_WARNING("GPU resource leaked: %s %u \"%s\" (%zu bytes)", GPU_RESOURCE_TYPE_NAMES[entry.first.first], entry.first.second,
+            entry.second.label.c_str(), entry.second.bytes);
+    }
+
+    size_t leaks = registry.live.size();
+    ULOG_INFO("GPU resources: peak %.1f MB, pool hits %zu / misses %zu, %zu leaked", registry.peakBytes / (1024.0 * 1024.0),
+        registry.poolHits, registry.poolMisses, leaks);
+
+    registry = GpuResourceRegistry();
+    registry.isShutDown = true;
+    return leaks;
+}
+
+
+// Reads the command line; returns false (after printing the usage) if it can't be understood
+bool UParseArguments(int argc, char* argv[], RunOptions& options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--software") == 0 && hasValue)
+        {
+            options.backend = RENDER_BACKEND_SOFTWARE;
+            options.outputFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--compare") == 0 && hasValue)
+        {
+            options.comparePrefix = argv[++i];
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && hasValue)
+        {
+            options.threadCount = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--on-demand") == 0)
+        {
+            options.isRenderOnDemand = true;
+        }
+        else if (strcmp(argv[i], "--capture") == 0 && hasValue && UIsValidCapturePattern(argv[i + 1]))
+        {
+            options.captureTarget = argv[++i];
+        }
+        else if (strcmp(argv[i], "--offscreen") == 0)
+        {
+            options.isOffscreen = true;
+        }
+        else if (strcmp(argv[i], "--frames") == 0 && hasValue)
+        {
+            options.frameCount = atoi(argv[++i]);
+        }
+        else
+        {
+            ULOG_ERROR("Usage: %s [--software <image.ppm>] [--compare <prefix>] [--threads <count>] [--on-demand]"
+                " [--capture <frame%%05d.png | video.yuv | \"|encoder command\">] [--offscreen] [--frames <count>]", argv[0]);
+            return false;
+        }
+    }
+    return true;
+}
+
+
+// Scene camera projection, shared by both backends
+glm::mat4 UGetProjection()
+{
+    return glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f);
+}
+
+
+// GPU-less path: renders one frame of the scene on the CPU and writes it out. Never touches GL.
+int URunSoftwareBackend(const RunOptions& options)
+{
+    UCreateMesh(gMesh, gCylinder, gSphere);
+    UBuildSceneObjects();
+
+    SoftwareRenderer renderer;
+    if (!UCreateSoftwareRenderer(renderer, gMaterials.materials, options.threadCount))
+        return EXIT_FAILURE;
+
+    SoftwareTarget target;
+    target.width = WINDOW_WIDTH;
+    target.height = WINDOW_HEIGHT;
+
+    // GLFW isn't initialized here, so time with the standard clock
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    URenderSoftware(renderer, target, gCamera.GetViewMatrix(), UGetProjection());
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    ULOG_INFO("SOFTWARE: %dx%d in %.2f ms (%.1f Mpixels/s), %d threads", target.width, target.height, elapsed * 1000.0,
+        target.width * target.height / elapsed / 1.0e6, (int)renderer.workers.size() + 1);
+
+    bool isWritten = UWritePpm(options.outputFile, target.color, target.width, target.height);
+    UDestroySoftwareRenderer(renderer);
+    return isWritten ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+// Renders the frame GL just drew again on the CPU and diffs the two. Writes <prefix>_gl.ppm,
+// <prefix>_software.ppm and <prefix>_diff.ppm; fails if too many pixels differ.
+int UCompareBackends(const char* prefix)
+{
+    std::vector<uint32_t> glPixels;
+    UReadRenderTarget(gSceneTarget, glPixels);
+
+    SoftwareRenderer renderer;
+    if (!UCreateSoftwareRenderer(renderer, gMaterials.materials, gRunOptions.threadCount))
+        return EXIT_FAILURE;
+
+    SoftwareTarget target;
+    target.width = gSceneTarget.renderWidth;
+    target.height = gSceneTarget.renderHeight;
+    URenderSoftware(renderer, target, gCamera.GetViewMatrix(), UGetProjection());
+    UDestroySoftwareRenderer(renderer);
+
+    std::vector<uint32_t> diffPixels;
+    ImageDiff diff = UCompareImages(glPixels, target.color, diffPixels);
+
+    std::string path(prefix);
+    UWritePpm((path + "_gl.ppm").c_str(), glPixels, target.width, target.height);
+    UWritePpm((path + "_software.ppm").c_str(), target.color, target.width, target.height);
+    UWritePpm((path + "_diff.ppm").c_str(), diffPixels, target.width, target.height);
+
+    bool isMatching = diff.mismatchRatio <= IMAGE_DIFF_MAX_MISMATCH;
+    ULOG_INFO("COMPARE: mean error %.3f, max error %d, %.3f%% of pixels differ by more than %d: %s", diff.meanError, diff.maxError,
+        diff.mismatchRatio * 100.0, IMAGE_DIFF_TOLERANCE, isMatching ? "MATCH" : "MISMATCH");
+    return isMatching ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+// Copies the rendered region of the scene target to memory, bottom row first
+void UReadRenderTarget(const RenderTarget& target, std::vector<uint32_t>& pixels)
+{
+    pixels.resize((size_t)target.renderWidth * target.renderHeight);
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, target.fbo);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    glReadPixels(0, 0, target.renderWidth, target.renderHeight, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+}
+
+
+// Per-pixel difference of two RGBA8 images of the same size. diffPixels gets the RGB difference, amplified.
+ImageDiff UCompareImages(const std::vector<uint32_t>& first, const std::vector<uint32_t>& second, std::vector<uint32_t>& diffPixels)
+{
+    ImageDiff diff;
+    diffPixels.assign(first.size(), 0xFF000000u);
+    if (first.size() != second.size() || first.empty())
+    {
+        diff.mismatchRatio = 1.0;
+        return diff;
+    }
+
+    double errorSum = 0.0;
+    size_t mismatches = 0;
+    for (size_t i = 0; i < first.size(); ++i)
+    {
+        int pixelError = 0;
+        uint32_t amplified = 0xFF000000u;
+        for (int channel = 0; channel < 3; ++channel)
+        {
+            int a = (first[i] >> (channel * 8)) & 0xFF;
+            int b = (second[i] >> (channel * 8)) & 0xFF;
+            int error = std::abs(a - b);
+            errorSum += error;
+            pixelError = std::max(pixelError, error);
+            amplified |= (uint32_t)std::min(error * 4, 255) << (channel * 8);
+        }
+
+        diffPixels[i] = amplified;
+        diff.maxError = std::max(diff.maxError, pixelError);
+        if (pixelError > IMAGE_DIFF_TOLERANCE)
+            ++mismatches;
+    }
+
+    diff.meanError = errorSum / (first.size() * 3.0);
+    diff.mismatchRatio = (double)mismatches / first.size();
+    return diff;
+}
+
+
+// Writes an RGBA8 image, bottom row first, as a binary PPM
+bool UWritePpm(const char* path, const std::vector<uint32_t>& pixels, int width, int height)
+{
+    FILE* file = fopen(path, "wb");
+    if (!file)
+    {
+        ULOG_ERROR("Cannot write %s", path);
+        return false;
+    }
+
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+    std::vector<unsigned char> row(width * 3);
+    for (int y = height - 1; y >= 0; --y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            uint32_t pixel = pixels[(size_t)y * width + x];
+            row[x * 3 + 0] = pixel & 0xFF;
+            row[x * 3 + 1] = (pixel >> 8) & 0xFF;
+            row[x * 3 + 2] = (pixel >> 16) & 0xFF;
+        }
+        fwrite(row.data(), 1, row.size(), file);
+    }
+
+    fclose(file);
+    return true;
+}
+
+
+// Loads the CPU copies of the material textures and starts the worker threads
+bool UCreateSoftwareRenderer(SoftwareRenderer& renderer, const std::vector<Material*>& materials, int threadCount)
+{
+    for (const Material* material : materials)
+    {
+        if (!(material->features & SHADER_FEATURE_TEXTURED))
+            continue;
+
+        // Same layout as the GL upload: RGBA8, flipped so the first row is t = 0
+        int width, height, channels;
+        unsigned char* image = stbi_load(material->textureFile, &width, &height, &channels, 4);
+        if (!image)
+        {
+            ULOG_ERROR("Failed to load texture %s", material->textureFile);
+            return false;
+        }
+        flipImageVertically(image, width, height, 4);
+
+        SoftwareTexture& texture = renderer.textures[material];
+        texture.width = width;
+        texture.height = height;
+        texture.texels.resize((size_t)width * height);
+        memcpy(texture.texels.data(), image, texture.texels.size() * sizeof(uint32_t));
+        stbi_image_free(image);
+    }
+
+    for (SoftwareTarget& face : renderer.shadowFaces)
+    {
+        face.width = SHADOW_MAP_SIZE;
+        face.height = SHADOW_MAP_SIZE;
+    }
+
+    // The calling thread rasterizes too
+    if (threadCount <= 0)
+        threadCount = std::max(1, (int)std::thread::hardware_concurrency());
+    for (int i = 1; i < threadCount; ++i)
+        renderer.workers.push_back(std::thread(USoftwareWorker, &renderer));
+
+    return true;
+}
+
+
+void UDestroySoftwareRenderer(SoftwareRenderer& renderer)
+{
+    {
+        std::lock_guard<std::mutex> lock(renderer.mutex);
+        renderer.isStopping = true;
+    }
+    renderer.wake.notify_all();
+
+    for (std::thread& worker : renderer.workers)
+        worker.join();
+    renderer.workers.clear();
+}
+
+
+// Worker thread: takes tiles of each pass it is woken for until none are left
+void USoftwareWorker(SoftwareRenderer* renderer)
+{
+    unsigned seenGeneration = 0;
+    for (;;)
+    {
+        const SoftwarePass* pass;
+        {
+            std::unique_lock<std::mutex> lock(renderer->mutex);
+            renderer->wake.wait(lock, [&] { return renderer->isStopping || renderer->generation != seenGeneration; });
+            if (renderer->isStopping)
+                return;
+
+            seenGeneration = renderer->generation;
+            pass = renderer->pass;
+        }
+
+        URunSoftwareTiles(*renderer, *pass);
+
+        std::lock_guard<std::mutex> lock(renderer->mutex);
+        if (--renderer->activeWorkers == 0)
+            renderer->finished.notify_one();
+    }
+}
+
+
+// Rasterizes every tile of the pass across the workers and the calling thread; returns when all are done
+void URunSoftwarePass(SoftwareRenderer& renderer, const SoftwarePass& pass)
+{
+    renderer.nextTile = 0;
+    {
+        std::lock_guard<std::mutex> lock(renderer.mutex);
+        renderer.pass = &pass;
+        renderer.activeWorkers = (int)renderer.workers.size();
+        ++renderer.generation;
+    }
+    renderer.wake.notify_all();
+
+    URunSoftwareTiles(renderer, pass);
+
+    std::unique_lock<std::mutex> lock(renderer.mutex);
+    renderer.finished.wait(lock, [&] { return renderer.activeWorkers == 0; });
+}
+
+
+void URunSoftwareTiles(SoftwareRenderer& renderer, const SoftwarePass& pass)
+{
+    int tileCount = pass.tilesX * pass.tilesY;
+    for (int tile = renderer.nextTile++; tile < tileCount; tile = renderer.nextTile++)
+        USoftwareRasterizeTile(renderer, pass, tile);
+}
+
+
+// Renders the scene objects into target (allocated here if needed) the way the GL surface shader does
+void URenderSoftware(SoftwareRenderer& renderer, SoftwareTarget& target, const glm::mat4& view, const glm::mat4& projection)
+{
+    URenderSoftwareShadows(renderer);
+
+    target.color.assign((size_t)target.width * target.height, 0xFF000000u); // Opaque black, like glClearColor
+    target.depth.assign((size_t)target.width * target.height, 1.0f);
+
+    glm::mat4 viewProjection = projection * view;
+    renderer.triangles.clear();
+    for (const SceneObject& object : gSceneObjects)
+        USetupSoftwareTriangles(renderer, *object.mesh, object.model, viewProjection, target, object.material);
+
+    SoftwarePass pass;
+    pass.target = &target;
+    pass.eyePosition = gCamera.Position;
+    UBinSoftwareTriangles(renderer, pass);
+    URunSoftwarePass(renderer, pass);
+
+    UProfilerSet("software.triangles", (double)renderer.triangles.size());
+}
+
+
+// Draws the shadow casters into the six CPU cube faces, storing distance to the light over
+// SHADOW_FAR_PLANE like shadow.frag. Skipped while the light and the casters stay put.
+void URenderSoftwareShadows(SoftwareRenderer& renderer)
+{
+    std::vector<glm::mat4> casters;
+    for (const SceneObject& object : gSceneObjects)
+    {
+        if (object.castsShadow)
+            casters.push_back(object.model);
+    }
+
+    if (renderer.isShadowValid && renderer.shadowLightPosition == gLightPosition && renderer.shadowCasters == casters)
+        return;
+
+    // Same face order, up vectors and projection as UDrawShadowCasters
+    const glm::vec3 directions[6] = {
+        glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(-1.0f, 0.0f, 0.0f),
+        glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f),
+        glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, 0.0f, -1.0f)
     };
+    const glm::vec3 ups[6] = {
+        glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f),
+        glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, 0.0f, -1.0f),
+        glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f)
+    };
+    glm::mat4 projection = glm::perspective(glm::radians(90.0f), 1.0f, 0.1f, SHADOW_FAR_PLANE);
+
+    for (int face = 0; face < 6; ++face)
+    {
+        SoftwareTarget& target = renderer.shadowFaces[face];
+        target.depth.assign((size_t)target.width * target.height, 1.0f);
+
+        glm::mat4 faceMatrix = projection * glm::lookAt(gLightPosition, gLightPosition + directions[face], ups[face]);
+        renderer.triangles.clear();
+        for (const SceneObject& object : gSceneObjects)
+        {
+            if (object.castsShadow)
+                USetupSoftwareTriangles(renderer, *object.mesh, object.model, faceMatrix, target, nullptr);
+        }
+
+        SoftwarePass pass;
+        pass.target = &target;
+        pass.isLightDistance = true;
+        pass.eyePosition = gLightPosition;
+        UBinSoftwareTriangles(renderer, pass);
+        URunSoftwarePass(renderer, pass);
+    }
+
+    renderer.isShadowValid = true;
+    renderer.shadowLightPosition = gLightPosition;
+    renderer.shadowCasters.swap(casters);
+}
+
+
+// Vertex stage, near/far clipping and triangle setup for one mesh instance; appends to renderer.triangles.
+// Attributes are fetched like the GL VAOs: position, normal from the second attribute, and texture
+// coordinates from floats 6 and 7 of the vertex (meshes without them read (0, 0)).
+void USetupSoftwareTriangles(SoftwareRenderer& renderer, const GLMesh& mesh, const glm::mat4& model, const glm::mat4& viewProjection,
+    const SoftwareTarget& target, const Material* material)
+{
+    glm::mat3 normalMatrix = glm::mat3(glm::transpose(glm::inverse(model)));
+    const std::vector<GLfloat>& data = mesh.vertices;
+
+    for (GLuint first = 0; first + 2 < mesh.nVertices; first += 3)
+    {
+        SoftwareVertex polygon[SOFTWARE_MAX_CLIPPED_VERTICES];
+        int count = 3;
+
+        for (int i = 0; i < 3; ++i)
+        {
+            size_t base = (size_t)(first + i) * 7;
+            glm::vec4 world = model * glm::vec4(data[base], data[base + 1], data[base + 2], 1.0f);
+
+            polygon[i].clipPosition = viewProjection * world;
+            polygon[i].worldPosition = glm::vec3(world);
+            polygon[i].normal = normalMatrix * glm::vec3(data[base + 3], data[base + 4], data[base + 5]);
+            polygon[i].textureCoordinate = glm::vec2(0.0f);
+            if (mesh.hasTextureCoordinates)
+                polygon[i].textureCoordinate = glm::vec2(data[base + 6], base + 7 < data.size() ? data[base + 7] : 0.0f);
+        }
+
+        // Clip against the near (z >= -w) and far (z <= w) planes; x and y are handled by the screen bounds
+        for (int plane = 0; plane < 2 && count > 0; ++plane)
+        {
+            float sign = plane == 0 ? 1.0f : -1.0f;
+            SoftwareVertex clipped[SOFTWARE_MAX_CLIPPED_VERTICES];
+            int clippedCount = 0;
+
+            for (int i = 0; i < count; ++i)
+            {
+                const SoftwareVertex& current = polygon[i];
+                const SoftwareVertex& next = polygon[(i + 1) % count];
+                float currentDistance = sign * current.clipPosition.z + current.clipPosition.w;
+                float nextDistance = sign * next.clipPosition.z + next.clipPosition.w;
+
+                if (currentDistance >= 0.0f)
+                    clipped[clippedCount++] = current;
+
+                if ((currentDistance >= 0.0f) != (nextDistance >= 0.0f))
+                {
+                    float t = currentDistance / (currentDistance - nextDistance);
+                    SoftwareVertex& vertex = clipped[clippedCount++];
+                    vertex.clipPosition = glm::mix(current.clipPosition, next.clipPosition, t);
+                    vertex.worldPosition = glm::mix(current.worldPosition, next.worldPosition, t);
+                    vertex.normal = glm::mix(current.normal, next.normal, t);
+                    vertex.textureCoordinate = glm::mix(current.textureCoordinate, next.textureCoordinate, t);
+                }
+            }
+
+            std::copy(clipped, clipped + clippedCount, polygon);
+            count = clippedCount;
+        }
+
+        // Fan out what is left of the polygon
+        for (int i = 1; i + 1 < count; ++i)
+            UAddSoftwareTriangle(renderer, polygon[0], polygon[i], polygon[i + 1], target, material);
+    }
+}
+
+
+// Projects a clipped triangle to the target and sets up its edge functions
+void UAddSoftwareTriangle(SoftwareRenderer& renderer, const SoftwareVertex& v0, const SoftwareVertex& v1, const SoftwareVertex& v2,
+    const SoftwareTarget& target, const Material* material)
+{
+    SoftwareTriangle triangle;
+    triangle.vertices[0] = v0;
+    triangle.vertices[1] = v1;
+    triangle.vertices[2] = v2;
+    triangle.material = material;
+
+    // Viewport transform; window y goes up like GL
+    glm::vec2 window[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        const glm::vec4& clip = triangle.vertices[i].clipPosition;
+        triangle.inverseW[i] = 1.0f / clip.w;
+        glm::vec3 ndc = glm::vec3(clip) * triangle.inverseW[i];
+        window[i] = glm::vec2((ndc.x + 1.0f) * 0.5f * target.width, (ndc.y + 1.0f) * 0.5f * target.height);
+        triangle.depth[i] = (ndc.z + 1.0f) * 0.5f;
+    }
+
+    // Edge i is opposite vertex i: E(p) = (b - a) x (p - a) for the edge from a to b
+    float doubleArea = 0.0f;
+    for (int i = 0; i < 3; ++i)
+    {
+        const glm::vec2& a = window[(i + 1) % 3];
+        const glm::vec2& b = window[(i + 2) % 3];
+        triangle.edgeA[i] = -(b.y - a.y);
+        triangle.edgeB[i] = b.x - a.x;
+        triangle.edgeC[i] = (b.y - a.y) * a.x - (b.x - a.x) * a.y;
+    }
+    doubleArea = triangle.edgeA[0] * window[0].x + triangle.edgeB[0] * window[0].y + triangle.edgeC[0];
+    if (doubleArea == 0.0f || !std::isfinite(doubleArea))
+        return;
+
+    // No face culling: clockwise triangles are flipped so inside is always positive
+    if (doubleArea < 0.0f)
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            triangle.edgeA[i] = -triangle.edgeA[i];
+            triangle.edgeB[i] = -triangle.edgeB[i];
+            triangle.edgeC[i] = -triangle.edgeC[i];
+        }
+        doubleArea = -doubleArea;
+    }
+    triangle.inverseArea = 1.0f / doubleArea;
+
+    // A pixel center exactly on an edge shared by two triangles belongs to only one of them
+    for (int i = 0; i < 3; ++i)
+        triangle.isTopLeft[i] = triangle.edgeA[i] > 0.0f || (triangle.edgeA[i] == 0.0f && triangle.edgeB[i] > 0.0f);
+
+    float minX = std::min(window[0].x, std::min(window[1].x, window[2].x));
+    float maxX = std::max(window[0].x, std::max(window[1].x, window[2].x));
+    float minY = std::min(window[0].y, std::min(window[1].y, window[2].y));
+    float maxY = std::max(window[0].y, std::max(window[1].y, window[2].y));
+    triangle.minX = std::max(0, (int)std::floor(minX));
+    triangle.minY = std::max(0, (int)std::floor(minY));
+    triangle.maxX = std::min(target.width - 1, (int)std::ceil(maxX));
+    triangle.maxY = std::min(target.height - 1, (int)std::ceil(maxY));
+    if (triangle.minX > triangle.maxX || triangle.minY > triangle.maxY)
+        return;
+
+    renderer.triangles.push_back(triangle);
+}
+
+
+// Sorts the triangles into the tiles their bounds overlap, keeping submission order within each tile
+void UBinSoftwareTriangles(SoftwareRenderer& renderer, SoftwarePass& pass)
+{
+    pass.tilesX = (pass.target->width + SOFTWARE_TILE_SIZE - 1) / SOFTWARE_TILE_SIZE;
+    pass.tilesY = (pass.target->height + SOFTWARE_TILE_SIZE - 1) / SOFTWARE_TILE_SIZE;
+    pass.triangles = &renderer.triangles;
+    pass.bins = &renderer.bins;
+
+    renderer.bins.resize((size_t)pass.tilesX * pass.tilesY);
+    for (std::vector<uint32_t>& bin : renderer.bins)
+        bin.clear();
+
+    for (size_t index = 0; index < renderer.triangles.size(); ++index)
+    {
+        const SoftwareTriangle& triangle = renderer.triangles[index];
+        for (int tileY = triangle.minY / SOFTWARE_TILE_SIZE; tileY <= triangle.maxY / SOFTWARE_TILE_SIZE; ++tileY)
+        {
+            for (int tileX = triangle.minX / SOFTWARE_TILE_SIZE; tileX <= triangle.maxX / SOFTWARE_TILE_SIZE; ++tileX)
+                renderer.bins[(size_t)tileY * pass.tilesX + tileX].push_back((uint32_t)index);
+        }
+    }
+}
+
+
+// Edge function values for the 2x2 quad whose bottom-left pixel is (x, y), lanes ordered
+// (x, y), (x + 1, y), (x, y + 1), (x + 1, y + 1). Returns the coverage mask of the four pixel centers.
+int USoftwareQuadCoverage(const SoftwareTriangle& triangle, int x, int y, float edges[3][4])
+{
+#ifdef SOFTWARE_RASTERIZER_SSE
+    const __m128 pixelX = _mm_add_ps(_mm_set1_ps(x + 0.5f), _mm_setr_ps(0.0f, 1.0f, 0.0f, 1.0f));
+    const __m128 pixelY = _mm_add_ps(_mm_set1_ps(y + 0.5f), _mm_setr_ps(0.0f, 0.0f, 1.0f, 1.0f));
+    const __m128 zero = _mm_setzero_ps();
+    __m128 inside = _mm_cmpeq_ps(zero, zero);
+
+    for (int i = 0; i < 3; ++i)
+    {
+        __m128 edge = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(triangle.edgeA[i]), pixelX),
+            _mm_mul_ps(_mm_set1_ps(triangle.edgeB[i]), pixelY)), _mm_set1_ps(triangle.edgeC[i]));
+        _mm_storeu_ps(edges[i], edge);
+        inside = _mm_and_ps(inside, triangle.isTopLeft[i] ? _mm_cmpge_ps(edge, zero) : _mm_cmpgt_ps(edge, zero));
+    }
+
+    return _mm_movemask_ps(inside);
+#else
+    int mask = 0;
+    for (int lane = 0; lane < 4; ++lane)
+    {
+        float pixelX = x + (lane & 1) + 0.5f;
+        float pixelY = y + (lane >> 1) + 0.5f;
+        bool isInside = true;
+        for (int i = 0; i < 3; ++i)
+        {
+            edges[i][lane] = triangle.edgeA[i] * pixelX + triangle.edgeB[i] * pixelY + triangle.edgeC[i];
+            isInside = isInside && (triangle.isTopLeft[i] ? edges[i][lane] >= 0.0f : edges[i][lane] > 0.0f);
+        }
+        if (isInside)
+            mask |= 1 << lane;
+    }
+    return mask;
+#endif
+}
+
 
-    // Generate VAO and VBO for rectangle
-    glGenVertexArrays(1, &(mesh.vao));
-    glGenBuffers(1, &(mesh.vbo));
-    glBindVertexArray(mesh.vao);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW);
+// Rasterizes the binned triangles of one tile in 2x2 quads, with a GL_LESS depth test
+void USoftwareRasterizeTile(const SoftwareRenderer& renderer, const SoftwarePass& pass, int tile)
+{
+    SoftwareTarget& target = *pass.target;
+    int tileX = (tile % pass.tilesX) * SOFTWARE_TILE_SIZE;
+    int tileY = (tile / pass.tilesX) * SOFTWARE_TILE_SIZE;
+    int tileMaxX = std::min(tileX + SOFTWARE_TILE_SIZE, target.width) - 1;
+    int tileMaxY = std::min(tileY + SOFTWARE_TILE_SIZE, target.height) - 1;
 
-    // Set vertex attribute pointers for rectangle
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 7 * sizeof(GLfloat), (GLvoid*)0);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 7 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 7 * sizeof(GLfloat), (GLvoid*)(6 * sizeof(GLfloat)));
-    glEnableVertexAttribArray(2);
+    for (uint32_t index : (*pass.bins)[tile])
+    {
+        const SoftwareTriangle& triangle = (*pass.triangles)[index];
 
+        // Quads start on even pixels, so they never straddle two tiles
+        int minX = std::max(triangle.minX, tileX) & ~1;
+        int minY = std::max(triangle.minY, tileY) & ~1;
+        int maxX = std::min(triangle.maxX, tileMaxX);
+        int maxY = std::min(triangle.maxY, tileMaxY);
 
-    mesh.nVertices = sizeof(verts) / (7 * sizeof(GLfloat));
+        for (int y = minY; y <= maxY; y += 2)
+        {
+            for (int x = minX; x <= maxX; x += 2)
+            {
+                float edges[3][4];
+                int mask = USoftwareQuadCoverage(triangle, x, y, edges);
+
+                for (int lane = 0; mask != 0; ++lane, mask >>= 1)
+                {
+                    int pixelX = x + (lane & 1);
+                    int pixelY = y + (lane >> 1);
+                    if (!(mask & 1) || pixelX > tileMaxX || pixelY > tileMaxY)
+                        continue;
+
+                    float weights[3] = { edges[0][lane] * triangle.inverseArea, edges[1][lane] * triangle.inverseArea, edges[2][lane] * triangle.inverseArea };
+                    size_t pixel = (size_t)pixelY * target.width + pixelX;
+                    UShadeSoftwarePixel(renderer, pass, triangle, weights, pixel);
+                }
+            }
+        }
+    }
+}
 
-    // Generate vertices for the cylinder
-    std::vector<GLfloat> cylVerts; // Holds cylinder vertices
-    int numSegments = 100;
-    float radius = 0.5f;
-    float height = 1.0f;
 
-    for (int i = 0; i <= numSegments; ++i)
+// Depth test, interpolation and shading of one covered pixel
+void UShadeSoftwarePixel(const SoftwareRenderer& renderer, const SoftwarePass& pass, const SoftwareTriangle& triangle, const float weights[3], size_t pixel)
+{
+    SoftwareTarget& target = *pass.target;
+
+    // Perspective-correct weights for the attributes; depth is interpolated in screen space
+    float perspective[3];
+    float perspectiveSum = 0.0f;
+    for (int i = 0; i < 3; ++i)
     {
-        float angle = glm::radians((float)i / (float)numSegments * 360.0f);
-        float x = cos(angle) * radius;
-        float z = sin(angle) * radius;
+        perspective[i] = weights[i] * triangle.inverseW[i];
+        perspectiveSum += perspective[i];
+    }
+    for (int i = 0; i < 3; ++i)
+        perspective[i] /= perspectiveSum;
 
-        // Top vertex
-        cylVerts.push_back(x);
-        cylVerts.push_back(0.5f * height);
-        cylVerts.push_back(z);
-        cylVerts.push_back(0.5f);
-        cylVerts.push_back(0.5f);
-        cylVerts.push_back(0.5f);
-        cylVerts.push_back(1.0f);
+    SoftwareVertex fragment;
+    fragment.worldPosition = perspective[0] * triangle.vertices[0].worldPosition + perspective[1] * triangle.vertices[1].worldPosition +
+        perspective[2] * triangle.vertices[2].worldPosition;
 
-        // Bottom vertex
-        cylVerts.push_back(x);
-        cylVerts.push_back(-0.5f * height);
-        cylVerts.push_back(z);
-        cylVerts.push_back(0.5f);
-        cylVerts.push_back(0.5f);
-        cylVerts.push_back(0.5f);
-        cylVerts.push_back(1.0f);
+    // Shadow pass: the depth written is the distance to the light, like gl_FragDepth in shadow.frag
+    if (pass.isLightDistance)
+    {
+        float distance = std::min(glm::length(fragment.worldPosition - pass.eyePosition) / SHADOW_FAR_PLANE, 1.0f);
+        if (distance < target.depth[pixel])
+            target.depth[pixel] = distance;
+        return;
     }
 
-    // Generate VAO and VBO for cylinder
-    glGenVertexArrays(1, &(cylinder.vao));
-    glGenBuffers(1, &(cylinder.vbo));
-    glBindVertexArray(cylinder.vao);
-    glBindBuffer(GL_ARRAY_BUFFER, cylinder.vbo);
-    glBufferData(GL_ARRAY_BUFFER, cylVerts.size() * sizeof(GLfloat), cylVerts.data(), GL_STATIC_DRAW);
+    float depth = weights[0] * triangle.depth[0] + weights[1] * triangle.depth[1] + weights[2] * triangle.depth[2];
+    if (!(depth < target.depth[pixel]))
+        return;
 
-    // Set vertex attribute pointers for cylinder
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 7 * sizeof(GLfloat), (GLvoid*)0);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 7 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
-    glEnableVertexAttribArray(1);
+    fragment.normal = perspective[0] * triangle.vertices[0].normal + perspective[1] * triangle.vertices[1].normal +
+        perspective[2] * triangle.vertices[2].normal;
+    fragment.textureCoordinate = perspective[0] * triangle.vertices[0].textureCoordinate + perspective[1] * triangle.vertices[1].textureCoordinate +
+        perspective[2] * triangle.vertices[2].textureCoordinate;
 
-    cylinder.nVertices = cylVerts.size() / 7;
+    glm::vec4 color;
+    if (!UShadeSoftwareFragment(renderer, pass, *triangle.material, fragment, color))
+        return;
 
-    // Generate vertices for the sphere
-    std::vector<GLfloat> sphereVerts; // Holds sphere vertices
+    // Float to UNORM8 as GL converts it
+    uint32_t packed = 0;
+    for (int channel = 0; channel < 4; ++channel)
+        packed |= (uint32_t)std::lround(glm::clamp(color[channel], 0.0f, 1.0f) * 255.0f) << (channel * 8);
 
-    for (int lat = 0; lat <= numSegments; ++lat)
+    target.depth[pixel] = depth;
+    target.color[pixel] = packed;
+}
+
+
+// surface.frag on the CPU, for the feature set of the material. Returns false if the fragment is discarded.
+bool UShadeSoftwareFragment(const SoftwareRenderer& renderer, const SoftwarePass& pass, const Material& material, const SoftwareVertex& fragment, glm::vec4& color)
+{
+    unsigned features = UNormalizeShaderFeatures(material.features);
+
+    // Base color: the texture when there is one, otherwise the flat material color
+    glm::vec4 baseColor(material.color, 1.0f);
+    if (features & SHADER_FEATURE_TEXTURED)
+        baseColor = USampleSoftwareTexture(renderer.textures.at(&material), fragment.textureCoordinate * material.uvScale, material.wrapMode);
+
+    if ((features & SHADER_FEATURE_ALPHA_TEST) && baseColor.a < material.alphaCutoff)
+        return false;
+
+    if (!(features & SHADER_FEATURE_LIT))
     {
-        float theta = glm::radians((float)lat / (float)numSegments * 180.0f);
-        float sinTheta = sin(theta);
-        float cosTheta = cos(theta);
+        color = glm::vec4(glm::vec3(baseColor), 1.0f);
+        return true;
+    }
 
-        for (int lon = 0; lon <= numSegments; ++lon)
-        {
-            float phi = glm::radians((float)lon / (float)numSegments * 360.0f);
-            float sinPhi = sin(phi);
-            float cosPhi = cos(phi);
+    // Phong: ambient, diffuse and (optionally) specular, with the same constants as the shader
+    glm::vec3 ambient = 0.1f * gLightColor;
 
-            float x = cosPhi * sinTheta;
-            float y = cosTheta;
-            float z = sinPhi * sinTheta;
+    glm::vec3 norm = glm::normalize(fragment.normal);
+    glm::vec3 lightDirection = glm::normalize(gLightPosition - fragment.worldPosition);
+    float impact = std::max(glm::dot(norm, lightDirection), 0.0f);
+    glm::vec3 diffuse = impact * gLightColor;
 
-            sphereVerts.push_back(radius * x);
-            sphereVerts.push_back(radius * y);
-            sphereVerts.push_back(radius * z);
-            sphereVerts.push_back(0.5f);
-            sphereVerts.push_back(0.5f);
-            sphereVerts.push_back(0.5f);
-            sphereVerts.push_back(1.0f);
-        }
+    glm::vec3 specular(0.0f);
+    if (features & SHADER_FEATURE_SPECULAR)
+    {
+        glm::vec3 viewDir = glm::normalize(pass.eyePosition - fragment.worldPosition);
+        glm::vec3 reflectDir = glm::reflect(-lightDirection, norm);
+        float specularComponent = std::pow(std::max(glm::dot(viewDir, reflectDir), 0.0f), 16.0f);
+        specular = 0.8f * specularComponent * gLightColor;
     }
 
-    // Generate VAO and VBO for sphere
-    glGenVertexArrays(1, &(sphere.vao));
-    glGenBuffers(1, &(sphere.vbo));
-    glBindVertexArray(sphere.vao);
-    glBindBuffer(GL_ARRAY_BUFFER, sphere.vbo);
-    glBufferData(GL_ARRAY_BUFFER, sphereVerts.size() * sizeof(GLfloat), sphereVerts.data(), GL_STATIC_DRAW);
+    float shadow = USoftwareShadowFactor(renderer, pass, fragment.worldPosition);
+    glm::vec3 phong = (ambient + (1.0f - shadow) * (diffuse + specular)) * glm::vec3(baseColor);
 
-    // Set vertex attribute pointers for sphere
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 7 * sizeof(GLfloat), (GLvoid*)0);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, 7 * sizeof(GLfloat), (GLvoid*)(3 * sizeof(GLfloat)));
-    glEnableVertexAttribArray(1);
+    color = glm::vec4(phong, 1.0f);
+    return true;
+}
 
-    sphere.nVertices = sphereVerts.size() / 7;
 
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindVertexArray(0);
+// shadowFactor() from surface.frag, against the CPU cube faces
+float USoftwareShadowFactor(const SoftwareRenderer& renderer, const SoftwarePass& pass, const glm::vec3& fragmentPosition)
+{
+    glm::vec3 lightToFragment = fragmentPosition - gLightPosition;
+    float currentDepth = glm::length(lightToFragment);
+    float bias = 0.05f;
+
+    if (gShadowPcfSamples <= 1)
+        return currentDepth - bias > USampleSoftwareShadow(renderer, lightToFragment) * SHADOW_FAR_PLANE ? 1.0f : 0.0f;
+
+    float diskRadius = (1.0f + glm::length(pass.eyePosition - fragmentPosition) / SHADOW_FAR_PLANE) / 25.0f;
+    float shadow = 0.0f;
+    for (int i = 0; i < gShadowPcfSamples; ++i)
+    {
+        float closestDepth = USampleSoftwareShadow(renderer, lightToFragment + PCF_OFFSETS[i] * diskRadius) * SHADOW_FAR_PLANE;
+        if (currentDepth - bias > closestDepth)
+            shadow += 1.0f;
+    }
+    return shadow / gShadowPcfSamples;
 }
 
 
-void UDestroyMesh(GLMesh& mesh)
+// Nearest-texel cube map lookup with the GL face selection rules
+float USampleSoftwareShadow(const SoftwareRenderer& renderer, const glm::vec3& direction)
 {
-    glDeleteVertexArrays(1, &mesh.vao);
-    glDeleteBuffers(1, &mesh.vbo);
+    glm::vec3 magnitude = glm::abs(direction);
+    int face;
+    float s, t, major;
+    if (magnitude.x >= magnitude.y && magnitude.x >= magnitude.z)
+    {
+        major = magnitude.x;
+        face = direction.x > 0.0f ? 0 : 1;
+        s = direction.x > 0.0f ? -direction.z : direction.z;
+        t = -direction.y;
+    }
+    else if (magnitude.y >= magnitude.z)
+    {
+        major = magnitude.y;
+        face = direction.y > 0.0f ? 2 : 3;
+        s = direction.x;
+        t = direction.y > 0.0f ? direction.z : -direction.z;
+    }
+    else
+    {
+        major = magnitude.z;
+        face = direction.z > 0.0f ? 4 : 5;
+        s = direction.z > 0.0f ? direction.x : -direction.x;
+        t = -direction.y;
+    }
+
+    const SoftwareTarget& target = renderer.shadowFaces[face];
+    int x = glm::clamp((int)std::floor(0.5f * (s / major + 1.0f) * target.width), 0, target.width - 1);
+    int y = glm::clamp((int)std::floor(0.5f * (t / major + 1.0f) * target.height), 0, target.height - 1);
+    return target.depth[(size_t)y * target.width + x];
 }
 
 
-/*Generate and load the texture*/
-bool UCreateTexture(const char* filename, GLuint& textureId)
+// Maps a texel coordinate into the texture for a wrap mode; -1 means the border color
+int UWrapTexel(int coordinate, int size, GLint wrapMode)
 {
-    int width, height, channels;
-    unsigned char* image = stbi_load(filename, &width, &height, &channels, 0);
-    if (image)
+    switch (wrapMode)
+    {
+    case GL_REPEAT:
+        return ((coordinate % size) + size) % size;
+    case GL_MIRRORED_REPEAT:
     {
-        flipImageVertically(image, width, height, channels);
+        int period = 2 * size;
+        int position = ((coordinate % period) + period) % period;
+        return position < size ? position : period - 1 - position;
+    }
+    case GL_CLAMP_TO_EDGE:
+        return glm::clamp(coordinate, 0, size - 1);
+    default: // GL_CLAMP_TO_BORDER
+        return coordinate < 0 || coordinate >= size ? -1 : coordinate;
+    }
+}
 
-        glGenTextures(1, &textureId);
-        glBindTexture(GL_TEXTURE_2D, textureId);
-
-        // set the texture wrapping parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        // set texture filtering parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-        if (channels == 3)
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-        else if (channels == 4)
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image);
-        else
+
+// Bilinear sample of the top level, as the material samplers (GL_LINEAR) do
+glm::vec4 USampleSoftwareTexture(const SoftwareTexture& texture, const glm::vec2& textureCoordinate, GLint wrapMode)
+{
+    const glm::vec4 borderColor(1.0f, 0.0f, 1.0f, 1.0f); // Matches the GL_CLAMP_TO_BORDER sampler
+
+    float u = textureCoordinate.x * texture.width - 0.5f;
+    float v = textureCoordinate.y * texture.height - 0.5f;
+    int x0 = (int)std::floor(u);
+    int y0 = (int)std::floor(v);
+    float fractionX = u - x0;
+    float fractionY = v - y0;
+
+    glm::vec4 texels[4];
+    for (int i = 0; i < 4; ++i)
+    {
+        int x = UWrapTexel(x0 + (i & 1), texture.width, wrapMode);
+        int y = UWrapTexel(y0 + (i >> 1), texture.height, wrapMode);
+        if (x < 0 || y < 0)
         {
-            cout << "Not implemented to handle image with " << channels << " channels" << endl;
-            return false;
+            texels[i] = borderColor;
+            continue;
         }
 
-        glGenerateMipmap(GL_TEXTURE_2D);
+        uint32_t texel = texture.texels[(size_t)y * texture.width + x];
+        texels[i] = glm::vec4(texel & 0xFF, (texel >> 8) & 0xFF, (texel >> 16) & 0xFF, texel >> 24) / 255.0f;
+    }
+
+    return glm::mix(glm::mix(texels[0], texels[1], fractionX), glm::mix(texels[2], texels[3], fractionX), fractionY);
+}
 
-        stbi_image_free(image);
-        glBindTexture(GL_TEXTURE_2D, 0); // Unbind the texture
 
+// A PNG capture target is used as a printf format for the frame number, so it may hold at most one
+// %d (with an optional 0 flag and width) and any number of %%. Other targets are not formats.
+bool UIsValidCapturePattern(const char* target)
+{
+    size_t length = strlen(target);
+    if (length <= 4 || strcmp(target + length - 4, ".png") != 0)
         return true;
+
+    int conversions = 0;
+    for (const char* c = target; *c; ++c)
+    {
+        if (*c != '%')
+            continue;
+
+        ++c;
+        if (*c == '%')
+            continue;
+
+        while (*c >= '0' && *c <= '9')
+            ++c;
+        if (*c != 'd' || ++conversions > 1)
+            return false;
     }
+    return true;
+}
+
 
-    // Error loading the image
+// Whether a valid PNG pattern has a %d, i.e. gives every frame its own file
+bool UHasCaptureFrameNumber(const char* pattern)
+{
+    for (const char* c = pattern; *c; ++c)
+    {
+        if (*c != '%')
+            continue;
+
+        if (*++c != '%')
+            return true;
+    }
     return false;
 }
 
 
+// Starts the encoder threads and opens the output. The target picks the format: a name ending in
+// .png is a per-frame file name pattern given the frame number as %d (without one the file always
+// holds the latest frame, e.g. a thumbnail), "|command" pipes raw I420 to an external encoder,
+// anything else is a raw I420 file. PNG patterns are checked by UIsValidCapturePattern.
+bool UCreateCapture(CaptureSystem& capture, const char* target)
+{
+    capture.target = target;
+    size_t length = capture.target.size();
+
+    if (length > 4 && capture.target.compare(length - 4, 4, ".png") == 0)
+    {
+        capture.format = CAPTURE_PNG;
+        capture.isSingleFile = !UHasCaptureFrameNumber(target);
+    }
+    else if (capture.target[0] == '|')
+    {
+        capture.format = CAPTURE_YUV_PIPE;
+#ifdef _WIN32
+        capture.stream = popen(capture.target.c_str() + 1, "wb"); // Text mode would turn every 0x0A into CR LF
+#else
+        capture.stream = popen(capture.target.c_str() + 1, "w");
+        signal(SIGPIPE, SIG_IGN); // An encoder that exits early fails the writes instead of killing us
+#endif
+    }
+    else
+    {
+        capture.format = CAPTURE_YUV_FILE;
+        capture.stream = fopen(capture.target.c_str(), "wb");
+    }
+
+    if (capture.format != CAPTURE_PNG && !capture.stream)
+    {
+        ULOG_ERROR("Cannot open capture output %s", target);
+        return false;
+    }
+
+    // Encoding is the slow part; leave the other cores to the driver and the render thread
+    int threadCount = std::min(std::max(1, (int)std::thread::hardware_concurrency() / 2), CAPTURE_MAX_ENCODERS);
+    for (int i = 0; i < threadCount; ++i)
+        capture.workers.push_back(std::thread(UCaptureWorker, &capture));
+
+    capture.isEnabled = true;
+    capture.windowStart = glfwGetTime();
+    ULOG_INFO("Capturing to %s (%s, %d encoder threads)", target, capture.format == CAPTURE_PNG ? "PNG" : "I420", threadCount);
+    return true;
+}
+
 
-void UDestroyTexture(GLuint textureId)
+// Finishes the readbacks in flight, lets the encoders drain the queue and closes the output
+void UDestroyCapture(CaptureSystem& capture)
 {
-    glGenTextures(1, &textureId);
+    if (!capture.isEnabled)
+        return;
+
+    UCollectCaptureSlots(capture, true);
+
+    // Readbacks the GPU didn't finish within the timeout are abandoned, fences and all
+    for (CaptureSlot& slot : capture.slots)
+    {
+        if (!slot.isPending)
+            continue;
+
+        glDeleteSync(slot.fence);
+        slot.fence = nullptr;
+        slot.isPending = false;
+        ++capture.droppedShutdown;
+    }
+    if (capture.droppedShutdown > 0)
+        ULOG_WARNING("Capture: dropped %u frames whose readback had not finished at shutdown", capture.droppedShutdown);
+
+    {
+        std::lock_guard<std::mutex> lock(capture.mutex);
+        capture.isStopping = true;
+    }
+    capture.wake.notify_all();
+
+    for (std::thread& worker : capture.workers)
+        worker.join();
+    capture.workers.clear();
+
+    if (capture.format == CAPTURE_YUV_PIPE)
+        pclose(capture.stream);
+    else if (capture.stream)
+        fclose(capture.stream);
+    capture.stream = nullptr;
+
+    for (CaptureSlot& slot : capture.slots)
+        slot.pbo.reset();
+
+    if (capture.streamWidth > 0)
+        ULOG_INFO("Capture stream: %dx%d I420", capture.streamWidth, capture.streamHeight);
+    capture.isEnabled = false;
 }
 
 
-// Implements the UCreateShaders function
-bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId)
+// Called once per rendered frame: hands finished readbacks to the encoders and starts reading
+// back the rendered region of target. Never waits for the GPU or the encoders.
+void UCaptureFrame(CaptureSystem& capture, const RenderTarget& target, double currentTime)
 {
-    // Compilation and linkage error reporting
-    int success = 0;
-    char infoLog[512];
+    if (!capture.isEnabled || target.fbo == 0)
+        return;
+
+    UCollectCaptureSlots(capture, false);
 
-    // Create a Shader program object.
-    programId = glCreateProgram();
+    ++capture.frame;
+    CaptureSlot& slot = capture.slots[capture.nextSlot];
+    if (slot.isPending)
+    {
+        // The GPU is a whole ring behind; waiting here would stall rendering
+        ++capture.droppedReadback;
+    }
+    else
+    {
+        slot.width = target.renderWidth;
+        slot.height = target.renderHeight;
+        slot.frame = capture.frame;
+
+        size_t bytes = (size_t)slot.width * slot.height * sizeof(uint32_t);
+        if (slot.pbo == 0)
+            slot.pbo = UCreateGpuBuffer(gGpuResources, GL_PIXEL_PACK_BUFFER, bytes, nullptr, GL_STREAM_READ, "capture readback");
+        else if (slot.bytes != bytes)
+            UResizeGpuBuffer(gGpuResources, slot.pbo, GL_PIXEL_PACK_BUFFER, bytes, nullptr, GL_STREAM_READ);
+        slot.bytes = bytes;
+
+        // With a pack buffer bound, glReadPixels only queues the copy
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, target.fbo);
+        glReadBuffer(GL_COLOR_ATTACHMENT0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+        glPixelStorei(GL_PACK_ALIGNMENT, 4);
+        glReadPixels(0, 0, slot.width, slot.height, GL_RGBA, GL_UNSIGNED_BYTE, (GLvoid*)0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+
+        slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        slot.isPending = true;
+        capture.nextSlot = (capture.nextSlot + 1) % CAPTURE_RING_SIZE;
+        ++capture.readbacks;
+    }
 
-    // Create the vertex and fragment shader objects
-    GLuint vertexShaderId = glCreateShader(GL_VERTEX_SHADER);
-    GLuint fragmentShaderId = glCreateShader(GL_FRAGMENT_SHADER);
+    UReportCaptureStats(capture, currentTime);
+}
 
-    // Retrive the shader source
-    glShaderSource(vertexShaderId, 1, &vtxShaderSource, NULL);
-    glShaderSource(fragmentShaderId, 1, &fragShaderSource, NULL);
 
-    // Compile the vertex shader, and print compilation errors (if any)
-    glCompileShader(vertexShaderId); // compile the vertex shader
-    // check for shader compile errors
-    glGetShaderiv(vertexShaderId, GL_COMPILE_STATUS, &success);
-    if (!success)
+// Moves every finished readback, oldest first, to the encoder queue. With wait set, blocks
+// up to CAPTURE_FLUSH_TIMEOUT on the oldest unfinished one (shutdown only); whatever is still
+// pending after that is left to the caller.
+void UCollectCaptureSlots(CaptureSystem& capture, bool wait)
+{
+    for (int i = 0; i < CAPTURE_RING_SIZE; ++i)
     {
-        glGetShaderInfoLog(vertexShaderId, 512, NULL, infoLog);
-        std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << std::endl;
+        CaptureSlot& slot = capture.slots[(capture.nextSlot + i) % CAPTURE_RING_SIZE];
+        if (!slot.isPending)
+            continue;
 
-        return false;
+        GLenum status = glClientWaitSync(slot.fence, wait ? GL_SYNC_FLUSH_COMMANDS_BIT : 0, wait ? CAPTURE_FLUSH_TIMEOUT : 0);
+        if (status == GL_TIMEOUT_EXPIRED)
+            return; // Later slots were issued after this one and can't be done either
+
+        glDeleteSync(slot.fence);
+        slot.fence = nullptr;
+        slot.isPending = false;
+        if (status == GL_WAIT_FAILED)
+            continue;
+
+        UQueueCaptureFrame(capture, slot);
+    }
+}
+
+
+// Copies a finished readback out of its PBO and queues it for encoding, unless the encoders are too far behind
+void UQueueCaptureFrame(CaptureSystem& capture, const CaptureSlot& slot)
+{
+    // A raw stream can't change size part way through
+    if (capture.format != CAPTURE_PNG)
+    {
+        if (capture.streamWidth == 0)
+        {
+            capture.streamWidth = slot.width;
+            capture.streamHeight = slot.height;
+        }
+        if (slot.width != capture.streamWidth || slot.height != capture.streamHeight)
+        {
+            ++capture.droppedSize;
+            return;
+        }
     }
 
-    glCompileShader(fragmentShaderId); // compile the fragment shader
-    // check for shader compile errors
-    glGetShaderiv(fragmentShaderId, GL_COMPILE_STATUS, &success);
-    if (!success)
+    CaptureFrame frame;
     {
-        glGetShaderInfoLog(fragmentShaderId, sizeof(infoLog), NULL, infoLog);
-        std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << std::endl;
+        std::lock_guard<std::mutex> lock(capture.mutex);
+        if (capture.queue.size() >= CAPTURE_QUEUE_DEPTH)
+        {
+            ++capture.droppedQueue;
+            return;
+        }
 
-        return false;
+        if (!capture.freeBuffers.empty())
+        {
+            frame.pixels.swap(capture.freeBuffers.back());
+            capture.freeBuffers.pop_back();
+        }
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+    const void* mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, slot.bytes, GL_MAP_READ_BIT);
+    if (mapped)
+    {
+        frame.pixels.resize((size_t)slot.width * slot.height);
+        memcpy(frame.pixels.data(), mapped, slot.bytes);
+    }
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    if (!mapped)
+        return;
+
+    frame.width = slot.width;
+    frame.height = slot.height;
+    frame.frame = slot.frame;
+    {
+        std::lock_guard<std::mutex> lock(capture.mutex);
+        frame.sequence = capture.nextSequence++;
+        capture.queue.push_back(std::move(frame));
+    }
+    capture.wake.notify_one();
+}
+
+
+// Encoder thread: encodes and writes queued frames until shutdown and an empty queue
+void UCaptureWorker(CaptureSystem* capture)
+{
+    std::vector<unsigned char> encoded;
+    for (;;)
+    {
+        CaptureFrame frame;
+        {
+            std::unique_lock<std::mutex> lock(capture->mutex);
+            capture->wake.wait(lock, [&] { return capture->isStopping || !capture->queue.empty(); });
+            if (capture->queue.empty())
+                return;
+
+            frame = std::move(capture->queue.front());
+            capture->queue.pop_front();
+        }
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        bool isWritten = UWriteCaptureFrame(*capture, frame, encoded);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::lock_guard<std::mutex> lock(capture->mutex);
+        capture->encodeTime += seconds;
+        if (isWritten)
+        {
+            ++capture->encoded;
+            capture->bytesWritten += encoded.size();
+        }
+        else
+        {
+            ++capture->failed;
+        }
+        capture->freeBuffers.push_back(std::move(frame.pixels));
     }
+}
 
-    // Attached compiled shaders to the shader program
-    glAttachShader(programId, vertexShaderId);
-    glAttachShader(programId, fragmentShaderId);
 
-    glLinkProgram(programId);   // links the shader program
-    // check for linking errors
-    glGetProgramiv(programId, GL_LINK_STATUS, &success);
-    if (!success)
+// Encodes one frame and writes it out. Writes to a stream or to a single PNG file wait for the frames
+// queued before this one, so the stream stays in order and the file ends up holding the newest frame.
+bool UWriteCaptureFrame(CaptureSystem& capture, const CaptureFrame& frame, std::vector<unsigned char>& encoded)
+{
+    if (capture.format == CAPTURE_PNG)
+    {
+        UEncodePng(frame, encoded);
+
+        // Files of their own need no ordering
+        if (!capture.isSingleFile)
+            return UWriteCapturePng(capture, frame, encoded);
+    }
+    else
     {
-        glGetProgramInfoLog(programId, sizeof(infoLog), NULL, infoLog);
-        std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+        UConvertToI420(frame, encoded);
+    }
+
+    std::unique_lock<std::mutex> lock(capture.writeMutex);
+    capture.writeTurn.wait(lock, [&] { return capture.nextWrite == frame.sequence; });
+    bool isWritten = capture.format == CAPTURE_PNG ? UWriteCapturePng(capture, frame, encoded) :
+                     fwrite(encoded.data(), 1, encoded.size(), capture.stream) == encoded.size();
+    ++capture.nextWrite;
+    lock.unlock();
+    capture.writeTurn.notify_all();
+
+    return isWritten;
+}
 
+
+// Writes an encoded PNG to the file the target pattern names for the frame
+bool UWriteCapturePng(const CaptureSystem& capture, const CaptureFrame& frame, const std::vector<unsigned char>& encoded)
+{
+    char fileName[1024];
+    snprintf(fileName, sizeof(fileName), capture.target.c_str(), (int)frame.frame);
+    FILE* file = fopen(fileName, "wb");
+    if (!file)
         return false;
+
+    bool isWritten = fwrite(encoded.data(), 1, encoded.size(), file) == encoded.size();
+    return fclose(file) == 0 && isWritten;
+}
+
+
+// Planar 4:2:0 YUV (BT.601, limited range), top row first; odd sizes round the chroma planes up
+void UConvertToI420(const CaptureFrame& frame, std::vector<unsigned char>& yuv)
+{
+    int width = frame.width;
+    int height = frame.height;
+    int chromaWidth = (width + 1) / 2;
+    int chromaHeight = (height + 1) / 2;
+    yuv.resize((size_t)width * height + 2 * (size_t)chromaWidth * chromaHeight);
+
+    unsigned char* planeY = yuv.data();
+    unsigned char* planeU = planeY + (size_t)width * height;
+    unsigned char* planeV = planeU + (size_t)chromaWidth * chromaHeight;
+
+    for (int y = 0; y < height; ++y)
+    {
+        const uint32_t* row = &frame.pixels[(size_t)(height - 1 - y) * width];
+        for (int x = 0; x < width; ++x)
+        {
+            int r = row[x] & 0xFF, g = (row[x] >> 8) & 0xFF, b = (row[x] >> 16) & 0xFF;
+            planeY[(size_t)y * width + x] = (unsigned char)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+        }
+    }
+
+    // Chroma from the average of each 2x2 block
+    for (int y = 0; y < chromaHeight; ++y)
+    {
+        for (int x = 0; x < chromaWidth; ++x)
+        {
+            int r = 0, g = 0, b = 0;
+            for (int i = 0; i < 4; ++i)
+            {
+                int sourceX = std::min(2 * x + (i & 1), width - 1);
+                int sourceY = std::min(2 * y + (i >> 1), height - 1);
+                uint32_t pixel = frame.pixels[(size_t)(height - 1 - sourceY) * width + sourceX];
+                r += pixel & 0xFF;
+                g += (pixel >> 8) & 0xFF;
+                b += (pixel >> 16) & 0xFF;
+            }
+            r /= 4;
+            g /= 4;
+            b /= 4;
+            planeU[(size_t)y * chromaWidth + x] = (unsigned char)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+            planeV[(size_t)y * chromaWidth + x] = (unsigned char)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+        }
     }
+}
 
-    glUseProgram(programId);    // Uses the shader program
 
-    return true;
+// CRC-32 as used by PNG chunks
+uint32_t UCrc32(const unsigned char* data, size_t length, uint32_t crc)
+{
+    // Encoder threads get here concurrently; a function-local static is initialized exactly once
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> entries;
+        for (uint32_t n = 0; n < 256; ++n)
+        {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k)
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            entries[n] = c;
+        }
+        return entries;
+    }();
+
+    crc = ~crc;
+    for (size_t i = 0; i < length; ++i)
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+
+// Appends a PNG chunk: length, type, data, CRC of type and data
+void UAppendPngChunk(std::vector<unsigned char>& png, const char* type, const unsigned char* data, size_t length)
+{
+    unsigned char header[8] = { (unsigned char)(length >> 24), (unsigned char)(length >> 16), (unsigned char)(length >> 8), (unsigned char)length,
+        (unsigned char)type[0], (unsigned char)type[1], (unsigned char)type[2], (unsigned char)type[3] };
+    png.insert(png.end(), header, header + 8);
+    png.insert(png.end(), data, data + length);
+
+    uint32_t crc = UCrc32(data, length, UCrc32(header + 4, 4, 0));
+    unsigned char footer[4] = { (unsigned char)(crc >> 24), (unsigned char)(crc >> 16), (unsigned char)(crc >> 8), (unsigned char)crc };
+    png.insert(png.end(), footer, footer + 4);
+}
+
+
+// 8-bit RGB PNG, top row first. The image data uses stored (uncompressed) deflate blocks: bigger
+// files, but encoding is a copy, which keeps up with the frame rate.
+void UEncodePng(const CaptureFrame& frame, std::vector<unsigned char>& png)
+{
+    static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+    png.assign(signature, signature + 8);
+
+    uint32_t width = frame.width;
+    uint32_t height = frame.height;
+    unsigned char header[13] = { (unsigned char)(width >> 24), (unsigned char)(width >> 16), (unsigned char)(width >> 8), (unsigned char)width,
+        (unsigned char)(height >> 24), (unsigned char)(height >> 16), (unsigned char)(height >> 8), (unsigned char)height,
+        8, 2, 0, 0, 0 }; // 8 bits, truecolor, deflate, adaptive filtering, no interlace
+    UAppendPngChunk(png, "IHDR", header, sizeof(header));
+
+    // Scanlines: filter type 0 then the RGB bytes
+    size_t rowBytes = 1 + (size_t)width * 3;
+    std::vector<unsigned char> scanlines(rowBytes * height);
+    for (uint32_t y = 0; y < height; ++y)
+    {
+        unsigned char* out = &scanlines[y * rowBytes];
+        const uint32_t* row = &frame.pixels[(size_t)(height - 1 - y) * width];
+        *out++ = 0;
+        for (uint32_t x = 0; x < width; ++x)
+        {
+            *out++ = row[x] & 0xFF;
+            *out++ = (row[x] >> 8) & 0xFF;
+            *out++ = (row[x] >> 16) & 0xFF;
+        }
+    }
+
+    // zlib stream: header, stored blocks of at most 65535 bytes, Adler-32
+    std::vector<unsigned char> zlib = { 0x78, 0x01 };
+    zlib.reserve(scanlines.size() + scanlines.size() / 65535 * 5 + 16);
+    size_t offset = 0;
+    do
+    {
+        size_t blockLength = std::min(scanlines.size() - offset, (size_t)65535);
+        bool isFinal = offset + blockLength == scanlines.size();
+        unsigned char blockHeader[5] = { (unsigned char)(isFinal ? 1 : 0), (unsigned char)blockLength, (unsigned char)(blockLength >> 8),
+            (unsigned char)~blockLength, (unsigned char)(~blockLength >> 8) };
+        zlib.insert(zlib.end(), blockHeader, blockHeader + 5);
+        zlib.insert(zlib.end(), scanlines.begin() + offset, scanlines.begin() + offset + blockLength);
+        offset += blockLength;
+    } while (offset < scanlines.size());
+
+    uint32_t a = 1, b = 0;
+    for (unsigned char byte : scanlines)
+    {
+        a = (a + byte) % 65521;
+        b = (b + a) % 65521;
+    }
+    uint32_t adler = (b << 16) | a;
+    unsigned char adlerBytes[4] = { (unsigned char)(adler >> 24), (unsigned char)(adler >> 16), (unsigned char)(adler >> 8), (unsigned char)adler };
+    zlib.insert(zlib.end(), adlerBytes, adlerBytes + 4);
+
+    UAppendPngChunk(png, "IDAT", zlib.data(), zlib.size());
+    UAppendPngChunk(png, "IEND", nullptr, 0);
 }
 
 
-void UDestroyShaderProgram(GLuint programId)
+// Publishes the capture throughput and drop counts once per profiler interval
+void UReportCaptureStats(CaptureSystem& capture, double currentTime)
 {
-    glDeleteProgram(programId);
+    double elapsed = currentTime - capture.windowStart;
+    if (elapsed < gProfiler.reportInterval)
+        return;
+
+    std::lock_guard<std::mutex> lock(capture.mutex);
+    UProfilerSet("capture.readbacks", capture.readbacks);
+    UProfilerSet("capture.encodedFps", capture.encoded / elapsed);
+    UProfilerSet("capture.encodeMs", capture.encoded > 0 ? 1000.0 * capture.encodeTime / capture.encoded : 0.0);
+    UProfilerSet("capture.MBps", capture.bytesWritten / elapsed / 1.0e6);
+    UProfilerSet("capture.droppedReadback", capture.droppedReadback);
+    UProfilerSet("capture.droppedQueue", capture.droppedQueue);
+    UProfilerSet("capture.droppedSize", capture.droppedSize);
+    UProfilerSet("capture.failed", capture.failed);
+    UProfilerSet("capture.queued", (double)capture.queue.size());
+
+    capture.windowStart = currentTime;
+    capture.readbacks = 0;
+    capture.droppedReadback = 0;
+    capture.droppedQueue = 0;
+    capture.droppedSize = 0;
+    capture.encoded = 0;
+    capture.failed = 0;
+    capture.encodeTime = 0.0;
+    capture.bytesWritten = 0;
 }